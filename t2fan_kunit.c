@@ -0,0 +1,891 @@
+// KUnit tests of t2fan_module.c, included at its end to reach the static
+// helpers and handlers
+// - opt-in: 'make T2FAN_KUNIT=1' against a kernel with CONFIG_KUNIT, the
+//   suites run when the module is loaded, e.g.
+//     modprobe kunit && insmod t2fan_module.ko backend=sim
+//   results in dmesg and /sys/kernel/debug/kunit/apple_fan/results
+// - 'T2FAN_KUNIT_BENCH=1' adds the 'apple_fan_bench' suite (handler timings)
+// - everything talking to the EC runs against a simulated EC of its own (no
+//   platform device, no hwmon) with its own latency and error rate, the
+//   module parameters of a live device are left alone
+
+#include <kunit/test.h>
+
+// calls per handler in the timing benchmarks
+#define APPLE_TEST_BENCH_LOOPS 1000
+
+// a device as set up by apple_fan_probe() and apple_fan_init_work(), minus
+// everything registered with other subsystems
+static int apple_fan_test_init(struct kunit *test) {
+  struct apple_fan *apple;
+  struct apple_fan_data *data;
+  int i;
+
+  apple = kunit_kzalloc(test, sizeof(*apple), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, apple);
+  data = kunit_kmalloc(test, sizeof(*data), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, data);
+  memcpy(data, &apple_data_defaults, sizeof(*data));
+
+  // hwmon_dev stays NULL, apple_fan_notify() drops the events
+  apple->data = data;
+  data->apple_fan_obj = apple;
+  data->backend = apple_fan_find_backend("sim");
+  KUNIT_ASSERT_NOT_NULL(test, data->backend);
+
+  data->stats = alloc_percpu(struct apple_fan_stats);
+  KUNIT_ASSERT_NOT_NULL(test, data->stats);
+  data->wq = alloc_ordered_workqueue(DRIVER_NAME "_test", 0);
+  if (!data->wq) {
+    free_percpu(data->stats);
+    KUNIT_FAIL(test, "no workqueue");
+    return -ENOMEM;
+  }
+
+  mutex_init(&data->ec_lock);
+  seqlock_init(&data->state_lock);
+  mutex_init(&data->update_lock);
+  mutex_init(&data->curve_lock);
+  mutex_init(&data->sweep_lock);
+  INIT_DELAYED_WORK(&data->sampler, apple_fan_sampler_work);
+  INIT_DELAYED_WORK(&data->controller, apple_fan_controller_work);
+  for (i = 0; i < APPLE_MAX_FANS; i++) {
+    data->speed[i].data = data;
+    data->speed[i].fan = i;
+    INIT_DELAYED_WORK(&data->speed[i].work, apple_fan_speed_work);
+    data->sweep[i].data = data;
+    data->sweep[i].fan = i;
+    INIT_DELAYED_WORK(&data->sweep[i].work, apple_fan_sweep_work);
+  }
+  test->priv = data;
+
+  data->backend->init(data);
+  // no EC latency and no injected errors unless a case asks for them
+  data->sim.latency_us = 0;
+  data->sim.error_rate = 0;
+  KUNIT_ASSERT_EQ(test, apple_fan_fans_init(data), 0);
+  // the fit, independent of the model and of the calibration params
+  for (i = 0; i < data->nr_fans; i++)
+    apple_fan_build_table(&data->calib[i], data->rpm_table[i]);
+  KUNIT_ASSERT_EQ(test, apple_fan_curves_init(data), 0);
+  apple_fan_temp_init(data);
+  return 0;
+}
+
+static void apple_fan_test_exit(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  int fan;
+
+  if (!data)
+    return;
+
+  // same order as apple_fan_remove()
+  for (fan = 0; fan < APPLE_MAX_FANS; fan++)
+    cancel_delayed_work_sync(&data->sweep[fan].work);
+  cancel_delayed_work_sync(&data->controller);
+  for (fan = 0; fan < APPLE_MAX_FANS; fan++)
+    cancel_delayed_work_sync(&data->speed[fan].work);
+  destroy_workqueue(data->wq);
+  apple_fan_curves_free(data);
+  free_percpu(data->stats);
+}
+
+static enum apple_fan_mode apple_test_mode(struct apple_fan_data *data,
+                                           int fan) {
+  enum apple_fan_mode mode;
+  int state;
+
+  apple_fan_read_state(data, fan, &state, &mode);
+  return mode;
+}
+
+static int apple_test_state(struct apple_fan_data *data, int fan) {
+  enum apple_fan_mode mode;
+  int state;
+
+  apple_fan_read_state(data, fan, &state, &mode);
+  return state;
+}
+
+// stand-in for the hwmon device, only carries 'data' as its drvdata
+static struct device *apple_test_dev(struct kunit *test) {
+  struct device *dev;
+
+  dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, dev);
+  dev_set_drvdata(dev, test->priv);
+  return dev;
+}
+
+// EC round-trips of all methods so far
+static u64 apple_test_ec_calls(struct apple_fan_data *data) {
+  u64 calls = 0;
+  int cpu, i;
+
+  for_each_possible_cpu(cpu) {
+    for (i = 0; i < APPLE_METHOD_COUNT; i++)
+      calls += per_cpu_ptr(data->stats, cpu)->methods[i].calls;
+  }
+  return calls;
+}
+
+// input of a text parser and the expected result, 'points' on success
+struct apple_test_input {
+  const char *buf;
+  int err;
+  int points;
+};
+
+// -------------------CONVERSIONS----------------------------- //
+
+static void apple_fan_test_fit_round_trip(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  const int *table = data->rpm_table[0];
+  int state;
+
+  // the fit is flat (0 RPM) below its offset, every state above it maps back
+  // onto itself
+  for (state = 1; state < APPLE_FAN_STATES; state++) {
+    if (table[state] <= table[state - 1])
+      continue;
+    KUNIT_EXPECT_EQ_MSG(test,
+                        apple_fan_rpm_to_state(
+                            table, apple_fan_state_to_rpm(table, state)),
+                        state, "state %d (%d RPM)", state, table[state]);
+  }
+  KUNIT_EXPECT_GT(test, table[APPLE_FAN_STATES - 1], 0);
+}
+
+static void apple_fan_test_calib_round_trip(struct kunit *test) {
+  struct apple_fan_calib calib = {
+      .npoints = 3,
+      .points = {{0, 1200}, {128, 3500}, {255, 6100}},
+  };
+  int *table;
+  int state;
+
+  table = kunit_kmalloc_array(test, APPLE_FAN_STATES, sizeof(*table),
+                              GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, table);
+  apple_fan_build_table(&calib, table);
+
+  // anchor points are exact, the table is strictly monotonic in between
+  KUNIT_EXPECT_EQ(test, table[0], 1200);
+  KUNIT_EXPECT_EQ(test, table[128], 3500);
+  KUNIT_EXPECT_EQ(test, table[255], 6100);
+  for (state = 0; state < APPLE_FAN_STATES; state++)
+    KUNIT_EXPECT_EQ(
+        test,
+        apple_fan_rpm_to_state(table, apple_fan_state_to_rpm(table, state)),
+        state);
+
+  // nearest state in between two entries
+  KUNIT_EXPECT_EQ(test, apple_fan_rpm_to_state(table, table[10] + 1), 10);
+  KUNIT_EXPECT_EQ(test, apple_fan_rpm_to_state(table, table[11] - 1), 11);
+}
+
+static void apple_fan_test_sweep_plausible(struct kunit *test) {
+  struct apple_fan_calib calib = {.npoints = APPLE_CALIB_MAX_POINTS};
+  int i;
+
+  // readings that follow the state
+  for (i = 0; i < calib.npoints; i++) {
+    calib.points[i].pwm = apple_fan_sweep_pwm(i);
+    calib.points[i].rpm = 1200 + i * 300;
+  }
+  KUNIT_EXPECT_TRUE(test, apple_fan_sweep_plausible(&calib));
+
+  // a stale value repeated at every step
+  for (i = 0; i < calib.npoints; i++)
+    calib.points[i].rpm = 2000;
+  KUNIT_EXPECT_FALSE(test, apple_fan_sweep_plausible(&calib));
+
+  // a single jump, flat everywhere else
+  calib.points[calib.npoints - 1].rpm = 6000;
+  KUNIT_EXPECT_FALSE(test, apple_fan_sweep_plausible(&calib));
+
+  // rising, but by less than SWEEP_MIN_SPAN_RPM overall
+  for (i = 0; i < calib.npoints; i++)
+    calib.points[i].rpm = 2000 + i;
+  KUNIT_EXPECT_FALSE(test, apple_fan_sweep_plausible(&calib));
+}
+
+static void apple_fan_test_conversion_limits(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  const int *table = data->rpm_table[0];
+
+  // stopped fan or failed read, faster than the table
+  KUNIT_EXPECT_EQ(test, apple_fan_rpm_to_state(table, 0), 0);
+  KUNIT_EXPECT_EQ(test, apple_fan_rpm_to_state(table, -1), 0);
+  KUNIT_EXPECT_EQ(test, apple_fan_rpm_to_state(table, INT_MAX), 255);
+  // unknown state (-1) and out of range states
+  KUNIT_EXPECT_EQ(test, apple_fan_state_to_rpm(table, -1), 0);
+  KUNIT_EXPECT_EQ(test, apple_fan_state_to_rpm(table, 1000),
+                  table[APPLE_FAN_STATES - 1]);
+}
+
+static void apple_fan_test_ema_weight(struct kunit *test) {
+  const u64 period = TEMP_EMA_PERIOD_MS * NSEC_PER_MSEC;
+
+  // off, whatever the refresh rate
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(100, 0), 1000U);
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(100, period / 10), 1000U);
+  // back-to-back refreshes (on-demand reads) hardly move the filter
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(50, 0), 0U);
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(50, period / 2), 250U);
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(50, period), 500U);
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(50, 2 * period), 750U);
+  // a long gap takes the reading as is
+  KUNIT_EXPECT_EQ(test, apple_fan_ema_weight(1, U64_MAX), 1000U);
+}
+
+// -------------------PARSERS----------------------------- //
+
+static const struct apple_test_input apple_test_calib_inputs[] = {
+    // an empty write returns to the fit
+    {"", 0, 0},
+    {"\n", 0, 0},
+    {"0:1200 255:6000", 0, 2},
+    {"0:0,128:3000,255:6000\n", 0, 3},
+    {" \t10:100\t20:200 ,", 0, 2},
+    {"0:1 1:2 2:3 3:4 4:5 5:6 6:7 7:8 8:9 9:10 10:11 11:12 12:13 13:14 "
+     "14:15 15:16",
+     0, 16},
+    // malformed
+    {"abc", -EINVAL},
+    {"10", -EINVAL},
+    {"10:", -EINVAL},
+    {":10", -EINVAL},
+    {"10:20abc", -EINVAL},
+    {"10x:20", -EINVAL},
+    {"10:20:30", -EINVAL},
+    {"10;20", -EINVAL},
+    {"0x10:20", -EINVAL},
+    // out of range
+    {"256:100", -EINVAL},
+    {"-1:100", -EINVAL},
+    {"10:-5", -EINVAL},
+    {"10:99999999999", -EINVAL},
+    // not ascending or too many points
+    {"20:100 10:200", -EINVAL},
+    {"10:100 10:200", -EINVAL},
+    {"10:200 20:100", -EINVAL},
+    {"0:1 1:2 2:3 3:4 4:5 5:6 6:7 7:8 8:9 9:10 10:11 11:12 12:13 13:14 "
+     "14:15 15:16 16:17",
+     -EINVAL},
+    // trailing garbage after valid points
+    {"0:1200 255:6000 x", -EINVAL},
+};
+
+static void apple_fan_test_parse_calib(struct kunit *test) {
+  const struct apple_test_input *in;
+  struct apple_fan_calib calib;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(apple_test_calib_inputs); i++) {
+    in = &apple_test_calib_inputs[i];
+    KUNIT_EXPECT_EQ_MSG(test,
+                        apple_fan_parse_calib(in->buf, strlen(in->buf), &calib),
+                        in->err, "'%s'", in->buf);
+    if (!in->err)
+      KUNIT_EXPECT_EQ_MSG(test, calib.npoints, in->points, "'%s'", in->buf);
+  }
+
+  // only 'count' bytes are parsed
+  KUNIT_EXPECT_EQ(test, apple_fan_parse_calib("0:1200 255:6000", 6, &calib), 0);
+  KUNIT_EXPECT_EQ(test, calib.npoints, 1);
+  KUNIT_EXPECT_EQ(test, calib.points[0].pwm, 0);
+  KUNIT_EXPECT_EQ(test, calib.points[0].rpm, 1200);
+}
+
+static const struct apple_test_input apple_test_curve_inputs[] = {
+    {"40:0 60:128 80:255", 0, 3},
+    {"30:50\n", 0, 1},
+    {" -10:0\t50:100 ", 0, 2},
+    {"1:1 2:2 3:3 4:4 5:5 6:6 7:7 8:8", 0, 8},
+    // a curve needs a point
+    {"", -EINVAL},
+    {"\n", -EINVAL},
+    // malformed, commas are no separator here
+    {"40", -EINVAL},
+    {"40:", -EINVAL},
+    {"40:10x", -EINVAL},
+    {"40:10:1", -EINVAL},
+    {"40:0,60:128", -EINVAL},
+    {"forty:10", -EINVAL},
+    // out of range
+    {"40:256", -EINVAL},
+    {"40:-1", -EINVAL},
+    {"99999999999:10", -EINVAL},
+    {"151:10", -EINVAL},
+    {"-51:10", -EINVAL},
+    {"-2000000000:0 2000000000:255", -EINVAL},
+    {"-50:0 150:255", 0, 2},
+    // not ascending or too many points
+    {"60:10 40:20", -EINVAL},
+    {"40:10 40:20", -EINVAL},
+    {"1:1 2:2 3:3 4:4 5:5 6:6 7:7 8:8 9:9", -EINVAL},
+};
+
+static void apple_fan_test_parse_curve(struct kunit *test) {
+  const struct apple_test_input *in;
+  struct apple_fan_curve curve;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(apple_test_curve_inputs); i++) {
+    in = &apple_test_curve_inputs[i];
+    KUNIT_EXPECT_EQ_MSG(test,
+                        apple_fan_parse_curve(in->buf, strlen(in->buf), &curve),
+                        in->err, "'%s'", in->buf);
+    if (!in->err)
+      KUNIT_EXPECT_EQ_MSG(test, curve.npoints, in->points, "'%s'", in->buf);
+  }
+}
+
+static void apple_fan_test_curve_eval(struct kunit *test) {
+  const struct apple_fan_curve curve = {
+      .npoints = 2,
+      .points = {{CURVE_TEMP_MIN, 0}, {CURVE_TEMP_MAX, 255}},
+      .hysteresis = CURVE_HYST_MAX,
+  };
+
+  KUNIT_EXPECT_EQ(test, apple_fan_curve_eval(&curve, INT_MIN), 0);
+  KUNIT_EXPECT_EQ(test, apple_fan_curve_eval(&curve, 50), 127);
+  KUNIT_EXPECT_EQ(test, apple_fan_curve_eval(&curve, INT_MAX), 255);
+
+  // the hysteresis offset must not wrap around at the extremes
+  KUNIT_EXPECT_EQ(test, apple_fan_curve_target(&curve, INT_MAX, 255), 255);
+  KUNIT_EXPECT_EQ(test, apple_fan_curve_target(&curve, INT_MIN, 100), 63);
+}
+
+static void apple_fan_test_set_curve(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct sensor_device_attribute attr = {.index = 0};
+  struct device *dev = apple_test_dev(test);
+  const struct apple_fan_curve *curve;
+  int npoints;
+
+  // a rejected write keeps the active curve
+  rcu_read_lock();
+  npoints = rcu_dereference(data->fan_curve[0])->npoints;
+  rcu_read_unlock();
+  KUNIT_EXPECT_EQ(test, fan_set_curve(dev, &attr.dev_attr, "40:256", 6),
+                  (ssize_t)-EINVAL);
+  rcu_read_lock();
+  KUNIT_EXPECT_EQ(test, rcu_dereference(data->fan_curve[0])->npoints, npoints);
+  rcu_read_unlock();
+
+  KUNIT_EXPECT_EQ(test,
+                  fan_set_curve(dev, &attr.dev_attr, "40:20 70:200\n", 13),
+                  (ssize_t)13);
+  rcu_read_lock();
+  curve = rcu_dereference(data->fan_curve[0]);
+  KUNIT_EXPECT_EQ(test, curve->npoints, 2);
+  KUNIT_EXPECT_EQ(test, curve->points[1].temp, 70);
+  KUNIT_EXPECT_EQ(test, curve->points[1].pwm, 200);
+  rcu_read_unlock();
+}
+
+// fanX_speed, parsed by the driver
+static const struct apple_test_input apple_test_speed_inputs[] = {
+    {"0", 0}, {"128\n", 0}, {"255", 0},
+    {"256", -EINVAL}, {"1000", -EINVAL}, {"-1", -EINVAL},
+    {"", -EINVAL}, {"\n", -EINVAL}, {"12a", -EINVAL}, {"0x10", -EINVAL},
+    {" 5", -EINVAL}, {"1 2", -EINVAL}, {"4294967296", -ERANGE},
+};
+
+static void apple_fan_test_set_speed_attr(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct sensor_device_attribute attr = {.index = 0};
+  struct device *dev = apple_test_dev(test);
+  const struct apple_test_input *in;
+  unsigned int state;
+  ssize_t ret;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(apple_test_speed_inputs); i++) {
+    in = &apple_test_speed_inputs[i];
+    ret = fan_set_speed_attr(dev, &attr.dev_attr, in->buf, strlen(in->buf));
+    KUNIT_EXPECT_EQ_MSG(test, ret,
+                        in->err ? (ssize_t)in->err : (ssize_t)strlen(in->buf),
+                        "'%s'", in->buf);
+    KUNIT_EXPECT_EQ(test, apple_fan_flush_speed(data), AE_OK);
+    if (in->err)
+      continue;
+
+    // accepted values reach the EC (no slew limit or deadband by default)
+    KUNIT_ASSERT_EQ(test, kstrtouint(in->buf, 10, &state), 0);
+    KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_MANUAL);
+    KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), (int)state);
+    KUNIT_EXPECT_EQ(test, data->sim.speed[0], (int)state);
+  }
+}
+
+// pwmX, parsed by the hwmon core, range checked by the driver
+static void apple_fan_test_pwm_input(struct kunit *test) {
+  static const struct {
+    long val;
+    int err;
+  } inputs[] = {
+      {0, 0},          {128, 0},          {255, 0},
+      {-1, -EINVAL},   {256, -EINVAL},    {LONG_MAX, -EINVAL},
+      {LONG_MIN, -EINVAL},
+  };
+  struct apple_fan_data *data = test->priv;
+  struct device *dev = apple_test_dev(test);
+  int i, last;
+
+  KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 0, "manual", 6), 6);
+  last = apple_test_state(data, 0);
+  for (i = 0; i < ARRAY_SIZE(inputs); i++) {
+    KUNIT_EXPECT_EQ_MSG(test,
+                        apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_input, 0,
+                                          inputs[i].val),
+                        inputs[i].err, "%ld", inputs[i].val);
+    KUNIT_EXPECT_EQ(test, apple_fan_flush_speed(data), AE_OK);
+    // a rejected value leaves the fan alone
+    if (!inputs[i].err)
+      last = inputs[i].val;
+    KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), last);
+  }
+}
+
+// -------------------HANDLERS----------------------------- //
+
+static void apple_fan_test_set_mode(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  int manual = (255 - data->fan_minimum[0]) >> 1;
+
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "manual\n", 7), 7);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_MANUAL);
+  KUNIT_EXPECT_EQ(test, data->fan_states[0], manual);
+  KUNIT_EXPECT_EQ(test, data->sim.speed[0], manual);
+
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "curve", 5), 5);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_CURVE);
+
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "auto\n", 5), 5);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_AUTO);
+  KUNIT_EXPECT_EQ(test, data->sim.speed[0], -1);
+
+  // "0" is an alias of auto
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "manual", 6), 6);
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "0\n", 2), 2);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_AUTO);
+}
+
+static void apple_fan_test_pwm_enable(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct device *dev = apple_test_dev(test);
+  long val;
+
+  // hwmon ABI: firmware control is automatic (2)
+  KUNIT_ASSERT_EQ(test, apple_hwmon_read(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                         &val),
+                  0);
+  KUNIT_EXPECT_EQ(test, val, 2L);
+
+  // auto -> manual (1) starts at the midpoint
+  KUNIT_ASSERT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          1),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_MANUAL);
+  KUNIT_EXPECT_EQ(test, apple_test_state(data, 0),
+                  (255 - data->fan_minimum[0]) >> 1);
+  KUNIT_EXPECT_EQ(test, data->sim.speed[0], apple_test_state(data, 0));
+  KUNIT_ASSERT_EQ(test, apple_hwmon_read(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                         &val),
+                  0);
+  KUNIT_EXPECT_EQ(test, val, 1L);
+
+  // manual -> manual keeps the state
+  KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, 200), AE_OK);
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          1),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), 200);
+
+  // the in-kernel curve is the second automatic mode (3)
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          3),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_CURVE);
+  KUNIT_ASSERT_EQ(test, apple_hwmon_read(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                         &val),
+                  0);
+  KUNIT_EXPECT_EQ(test, val, 3L);
+
+  // no full speed (0), nothing beyond the curve
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          0),
+                  -EINVAL);
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          4),
+                  -EINVAL);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_CURVE);
+
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_enable, 0,
+                                          2),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_AUTO);
+}
+
+static void apple_fan_test_deadband_after_slew(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+
+  KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, 100), AE_OK);
+  WRITE_ONCE(data->fan_slew[0], 4);
+  WRITE_ONCE(data->fan_deadband[0], 10);
+
+  // start a slew towards 200, then take the fan elsewhere directly
+  mutex_lock(&data->ec_lock);
+  KUNIT_EXPECT_EQ(test, __fan_limit_state(data, 0, 200, FAN_SLEW_PERIOD), 101);
+  mutex_unlock(&data->ec_lock);
+  KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, 150), AE_OK);
+
+  // the abandoned slew must not let small moves through the deadband
+  mutex_lock(&data->ec_lock);
+  KUNIT_EXPECT_EQ(test, __fan_limit_state(data, 0, 155, FAN_SLEW_PERIOD), -1);
+
+  // same for a mode change in between
+  KUNIT_EXPECT_EQ(test, __fan_limit_state(data, 0, 200, FAN_SLEW_PERIOD), 151);
+  write_seqlock(&data->state_lock);
+  apple_fan_switch_mode(data, 0, APPLE_FAN_MODE_CURVE);
+  apple_fan_switch_mode(data, 0, APPLE_FAN_MODE_MANUAL);
+  write_sequnlock(&data->state_lock);
+  KUNIT_EXPECT_EQ(test, __fan_limit_state(data, 0, 155, FAN_SLEW_PERIOD), -1);
+  mutex_unlock(&data->ec_lock);
+}
+
+static void apple_fan_test_set_mode_invalid(struct kunit *test) {
+  static const char *const invalid[] = {
+      "", "\n", "autoxyz", "0manual", "Manual", "man", "curves", "1", " auto",
+  };
+  struct apple_fan_data *data = test->priv;
+  int i;
+
+  KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 0, "manual", 6), 6);
+  for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+    KUNIT_EXPECT_EQ_MSG(test,
+                        _fan_set_mode(data, 0, invalid[i], strlen(invalid[i])),
+                        (ssize_t)-EINVAL, "'%s'", invalid[i]);
+    // a rejected write leaves the fan alone
+    KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_MANUAL);
+  }
+}
+
+static void apple_fan_test_set_mode_sweeping(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct sensor_device_attribute attr = {.index = 0};
+  struct device *dev = apple_test_dev(test);
+
+  if (data->nr_fans < 2)
+    kunit_skip(test, "needs two simulated fans (sim_fans)");
+  KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 1, "manual", 6), 6);
+
+  // a real sweep of fan 0, aborted before its first poll
+  KUNIT_ASSERT_EQ(test, apple_fan_sweep_start(data, 0), 0);
+  KUNIT_EXPECT_TRUE(test, apple_fan_sweeping(data, 0));
+  KUNIT_EXPECT_EQ(test, apple_fan_sweep_start(data, 0), -EBUSY);
+
+  // the sweeping fan itself and auto-mode of any fan are refused
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 0, "manual", 6), (ssize_t)-EBUSY);
+  KUNIT_EXPECT_EQ(test, fan_set_speed_attr(dev, &attr.dev_attr, "100", 3),
+                  (ssize_t)-EBUSY);
+  KUNIT_EXPECT_EQ(test, apple_hwmon_write(dev, hwmon_pwm, hwmon_pwm_input, 0,
+                                          100),
+                  -EBUSY);
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 1, "auto", 4), (ssize_t)-EBUSY);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 1), APPLE_FAN_MODE_MANUAL);
+  // other fans stay under user control
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 1, "curve", 5), 5);
+
+  // the abort restores the saved auto-mode, fan 0 stays at its minimum as
+  // long as fan 1 is claimed
+  apple_fan_sweep_abort(data, 0);
+  KUNIT_EXPECT_FALSE(test, apple_fan_sweeping(data, 0));
+  KUNIT_EXPECT_EQ(test, data->sweep[0].status, APPLE_SWEEP_ABORTED);
+  KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), data->fan_minimum[0]);
+
+  KUNIT_EXPECT_EQ(test, _fan_set_mode(data, 1, "auto", 4), 4);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_AUTO);
+}
+
+static void apple_fan_test_cooling_state(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct thermal_cooling_device cdev = {.devdata = &data->cooling[0]};
+  unsigned long state;
+
+  if (data->nr_fans < 2)
+    kunit_skip(test, "needs two simulated fans (sim_fans)");
+  data->cooling[0].data = data;
+  data->cooling[0].fan = 0;
+  // lifts state 1 (pwm 26) to pwm 100
+  data->fan_minimum[0] = 100;
+
+  // the governor reads back what it asked for
+  KUNIT_ASSERT_EQ(test, apple_fan_cooling_set_cur_state(&cdev, 1), 0);
+  KUNIT_EXPECT_EQ(test, data->sim.speed[0], 100);
+  KUNIT_EXPECT_EQ(test, apple_fan_cooling_get_cur_state(&cdev, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, 1UL);
+
+  // state 0 holds the minimum while fan 2 is claimed
+  KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 1, "manual", 6), 6);
+  KUNIT_ASSERT_EQ(test, apple_fan_cooling_set_cur_state(&cdev, 0), 0);
+  KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), 100);
+  KUNIT_EXPECT_EQ(test, apple_fan_cooling_get_cur_state(&cdev, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, 0UL);
+
+  // a repeated state 0 leaves it there
+  KUNIT_EXPECT_EQ(test, apple_fan_cooling_set_cur_state(&cdev, 0), 0);
+  KUNIT_EXPECT_TRUE(test, data->cooling[0].active);
+
+  // auto-mode takes the fan back from the governor
+  KUNIT_ASSERT_EQ(test, apple_fan_user_set_auto(data), 0);
+  KUNIT_EXPECT_FALSE(test, data->cooling[0].active);
+
+  // a user-selected speed is reported as is
+  KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, 255), AE_OK);
+  KUNIT_EXPECT_EQ(test, apple_fan_cooling_get_cur_state(&cdev, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, (unsigned long)APPLE_COOLING_STATES);
+}
+
+static void apple_fan_test_set_auto(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  unsigned long state;
+  int fan;
+
+  for (fan = 0; fan < data->nr_fans; fan++)
+    KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, fan, 200), AE_OK);
+  data->cooling[0].active = true;
+  apple_fan_update_if_older(data, 0);
+  KUNIT_ASSERT_FALSE(test, apple_fan_is_stale(data, 0));
+
+  KUNIT_EXPECT_EQ(test, fan_set_auto(data), AE_OK);
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    KUNIT_EXPECT_EQ(test, apple_test_mode(data, fan), APPLE_FAN_MODE_AUTO);
+    KUNIT_EXPECT_EQ(test, data->fan_states[fan], -1);
+    KUNIT_EXPECT_EQ(test, data->pending_speed[fan], -1);
+    KUNIT_EXPECT_FALSE(test, data->cooling[fan].active);
+    KUNIT_EXPECT_EQ(test, data->sim.speed[fan], -1);
+  }
+
+  // the manual mode rpm in the cache is outdated, refreshed on the next read
+  KUNIT_EXPECT_TRUE(test, apple_fan_is_stale(data, 0));
+  apple_fan_update_if_older(data, 0);
+  KUNIT_EXPECT_FALSE(test, apple_fan_is_stale(data, 0));
+  KUNIT_EXPECT_EQ(test, data->fan_rpm_status[0], AE_OK);
+  KUNIT_EXPECT_EQ(test, __fan_get_cur_state(data, 0, &state), 0);
+
+  // the EC refusing auto-mode is reported
+  data->sim.error_rate = 1000;
+  KUNIT_EXPECT_NE(test, fan_set_auto(data), AE_OK);
+  data->sim.error_rate = 0;
+}
+
+static void apple_fan_test_profile_set(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  const struct apple_fan_profile *preset =
+      &apple_fan_profiles[PLATFORM_PROFILE_PERFORMANCE];
+  int fan;
+
+  // fan 1 stays under firmware control, fan 2 (if any) runs its curve
+  if (data->nr_fans > 1)
+    KUNIT_ASSERT_EQ(test, apple_fan_set_curve_mode(data, 1), 0);
+
+  KUNIT_EXPECT_EQ(test,
+                  apple_fan_profile_set(&data->profile_handler,
+                                        PLATFORM_PROFILE_PERFORMANCE),
+                  0);
+  KUNIT_EXPECT_EQ(test, data->profile, PLATFORM_PROFILE_PERFORMANCE);
+  KUNIT_EXPECT_EQ(test, data->max_fan_speed_setting, preset->max_speed);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_AUTO);
+  if (data->nr_fans > 1)
+    KUNIT_EXPECT_EQ(test, apple_test_mode(data, 1), APPLE_FAN_MODE_CURVE);
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    KUNIT_EXPECT_EQ(test, data->fan_minimum[fan], preset->minimum);
+    rcu_read_lock();
+    KUNIT_EXPECT_EQ(test, rcu_dereference(data->fan_curve[fan])->npoints,
+                    preset->curve.npoints);
+    rcu_read_unlock();
+  }
+
+  // a manual speed survives a profile switch
+  KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 0, "manual", 6), 6);
+  KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, 150), AE_OK);
+  KUNIT_EXPECT_EQ(test,
+                  apple_fan_profile_set(&data->profile_handler,
+                                        PLATFORM_PROFILE_LOW_POWER),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_mode(data, 0), APPLE_FAN_MODE_MANUAL);
+  KUNIT_EXPECT_EQ(test, apple_test_state(data, 0), 150);
+}
+
+static void apple_fan_test_set_max_speed(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  unsigned long state;
+
+  KUNIT_EXPECT_EQ(test, fan_set_max_speed(data, 100, false), AE_OK);
+  KUNIT_EXPECT_EQ(test, data->sim.max_speed, 100);
+  KUNIT_EXPECT_EQ(test, fan_get_max_speed(data, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, 100UL);
+
+  // a reset ignores 'state' and restores the default max speed
+  KUNIT_EXPECT_EQ(test, fan_set_max_speed(data, 10, true), AE_OK);
+  KUNIT_EXPECT_EQ(test, data->sim.max_speed, 255);
+  KUNIT_EXPECT_EQ(test, fan_get_max_speed(data, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, 255UL);
+
+  // a failed write keeps the last setting
+  data->sim.error_rate = 1000;
+  KUNIT_EXPECT_NE(test, fan_set_max_speed(data, 50, false), AE_OK);
+  KUNIT_EXPECT_NE(test, fan_set_max_speed(data, 50, true), AE_OK);
+  data->sim.error_rate = 0;
+  KUNIT_EXPECT_EQ(test, fan_get_max_speed(data, &state), 0);
+  KUNIT_EXPECT_EQ(test, state, 255UL);
+  KUNIT_EXPECT_EQ(test, data->sim.max_speed, 255);
+}
+
+static void apple_fan_test_read_on_demand(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  struct device *dev = apple_test_dev(test);
+  u64 calls;
+  long val;
+
+  if (max_age)
+    kunit_skip(test, "max_age is set");
+
+  // without the sampler a read only refreshes the value it returns
+  data->update_interval = 0;
+
+  calls = apple_test_ec_calls(data);
+  KUNIT_EXPECT_EQ(test, apple_hwmon_read(dev, hwmon_fan, hwmon_fan_input, 0,
+                                         &val),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_ec_calls(data), calls + 1);
+
+  calls = apple_test_ec_calls(data);
+  KUNIT_EXPECT_EQ(test, apple_hwmon_read(dev, hwmon_temp, hwmon_temp_input, 0,
+                                         &val),
+                  0);
+  KUNIT_EXPECT_EQ(test, apple_test_ec_calls(data), calls + 1);
+  KUNIT_EXPECT_EQ(test, val, data->temp[0]);
+}
+
+// -------------------BENCHMARKS----------------------------- //
+
+#ifdef T2FAN_KUNIT_BENCH
+
+static void apple_test_bench_report(struct kunit *test, const char *name,
+                                    u64 start) {
+  kunit_info(test, "%-24s %6llu ns/call", name,
+             div_u64(ktime_get_ns() - start, APPLE_TEST_BENCH_LOOPS));
+}
+
+// per-call cost of the handlers without EC latency (per-device latency 0),
+// i.e. locking, bookkeeping and the simulated EC model - informational only
+static void apple_fan_test_bench_handlers(struct kunit *test) {
+  struct apple_fan_data *data = test->priv;
+  unsigned long state, sum = 0;
+  u64 start;
+  int i;
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    sum += apple_fan_rpm_to_state(data->rpm_table[0], 1000 + i * 5);
+  apple_test_bench_report(test, "apple_fan_rpm_to_state", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    sum += apple_fan_state_to_rpm(data->rpm_table[0], i & 0xff);
+  apple_test_bench_report(test, "apple_fan_state_to_rpm", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++) {
+    __fan_get_cur_state(data, 0, &state);
+    sum += state;
+  }
+  apple_test_bench_report(test, "__fan_get_cur_state", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    KUNIT_ASSERT_EQ(test, _fan_set_mode(data, 0, "manual", 6), 6);
+  apple_test_bench_report(test, "_fan_set_mode(manual)", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    KUNIT_ASSERT_EQ(test, __fan_set_cur_state(data, 0, i & 0xff), AE_OK);
+  apple_test_bench_report(test, "__fan_set_cur_state", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    KUNIT_ASSERT_EQ(test, fan_set_auto(data), AE_OK);
+  apple_test_bench_report(test, "fan_set_auto", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    KUNIT_ASSERT_EQ(test, fan_set_max_speed(data, i & 0xff, false), AE_OK);
+  apple_test_bench_report(test, "fan_set_max_speed", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    apple_fan_update_fan(data, 0);
+  apple_test_bench_report(test, "apple_fan_update_fan", start);
+
+  start = ktime_get_ns();
+  for (i = 0; i < APPLE_TEST_BENCH_LOOPS; i++)
+    apple_fan_update_temp(data, 0);
+  apple_test_bench_report(test, "apple_fan_update_temp", start);
+
+  // keeps the loops above from being optimized away
+  kunit_info(test, "checksum %lu", sum);
+}
+
+static struct kunit_case apple_fan_bench_cases[] = {
+    KUNIT_CASE_SLOW(apple_fan_test_bench_handlers),
+    {},
+};
+
+static struct kunit_suite apple_fan_bench_suite = {
+    .name = DRIVER_NAME "_bench",
+    .init = apple_fan_test_init,
+    .exit = apple_fan_test_exit,
+    .test_cases = apple_fan_bench_cases,
+};
+
+kunit_test_suite(apple_fan_bench_suite);
+#endif
+
+static struct kunit_case apple_fan_test_cases[] = {
+    KUNIT_CASE(apple_fan_test_fit_round_trip),
+    KUNIT_CASE(apple_fan_test_calib_round_trip),
+    KUNIT_CASE(apple_fan_test_sweep_plausible),
+    KUNIT_CASE(apple_fan_test_conversion_limits),
+    KUNIT_CASE(apple_fan_test_ema_weight),
+    KUNIT_CASE(apple_fan_test_parse_calib),
+    KUNIT_CASE(apple_fan_test_parse_curve),
+    KUNIT_CASE(apple_fan_test_curve_eval),
+    KUNIT_CASE(apple_fan_test_set_curve),
+    KUNIT_CASE(apple_fan_test_set_speed_attr),
+    KUNIT_CASE(apple_fan_test_pwm_input),
+    KUNIT_CASE(apple_fan_test_set_mode),
+    KUNIT_CASE(apple_fan_test_set_mode_invalid),
+    KUNIT_CASE(apple_fan_test_pwm_enable),
+    KUNIT_CASE(apple_fan_test_deadband_after_slew),
+    KUNIT_CASE(apple_fan_test_set_mode_sweeping),
+    KUNIT_CASE(apple_fan_test_cooling_state),
+    KUNIT_CASE(apple_fan_test_set_auto),
+    KUNIT_CASE(apple_fan_test_set_max_speed),
+    KUNIT_CASE(apple_fan_test_profile_set),
+    KUNIT_CASE(apple_fan_test_read_on_demand),
+    {},
+};
+
+static struct kunit_suite apple_fan_test_suite = {
+    .name = DRIVER_NAME,
+    .init = apple_fan_test_init,
+    .exit = apple_fan_test_exit,
+    .test_cases = apple_fan_test_cases,
+};
+
+kunit_test_suite(apple_fan_test_suite);
@@ -1,15 +1,42 @@
-
 #include <linux/fs.h>
 #include <linux/module.h>
 
 #include <linux/acpi.h>
+#include <linux/cpufreq.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/dmi.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#include <linux/platform_profile.h>
+#include <linux/poll.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/thermal.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <linux/hwmon-sysfs.h>
 #include <linux/hwmon.h>
 
+#define CREATE_TRACE_POINTS
+#include "t2fan_trace.h"
+
 // -------- DEFINES / MACROS -----------
 
 #define to_platform_driver(drv)                                                \
@@ -22,11 +49,135 @@
 
 #define TEMP1_CRIT 105
 #define TEMP1_LABEL "gfx_temp"
-#define PATH "\\_SB_.PCI0.LPCB.SMC_";
-
+// default temp1_max alarm threshold (degree celsius)
+#define TEMP1_MAX_DEFAULT 90
+// max number of temperature sensors exposed as temp1..tempN
+#define APPLE_MAX_TEMPS 8
+// crit value of sensors without a firmware provided one (degree celsius)
+#define TEMP_CRIT_DEFAULT 100
+// plausible range of a sensor readout during discovery (degree celsius)
+#define TEMP_PROBE_MIN 1
+#define TEMP_PROBE_MAX 150
+
+// empirical fit of the fan state reported for a speed, scaled by FAN_FIT_SCALE
+// - state = FAN_FIT_A * rpm^2 + FAN_FIT_B * rpm + FAN_FIT_C
+// - i.e. RPM*RPM*0,0000095+0,01028*RPM+26,5
+#define FAN_FIT_SCALE 10000000ULL
+#define FAN_FIT_A 95ULL
+#define FAN_FIT_B 102800ULL
+#define FAN_FIT_C 265000000ULL
+
+// max number of fans (fan1..fanN), the actual count is found during probe
+#define APPLE_MAX_FANS 4
+// fan count assumed if the firmware can't tell
+#define APPLE_FANS_DEFAULT 2
+// fan discovery is retried this often, the wait doubling from
+// FANS_INIT_RETRY_MS (ms), before the driver gives up
+#define FANS_INIT_RETRIES 5
+#define FANS_INIT_RETRY_MS 100
+
+// fan state <-> RPM calibration: anchor points and table size (states)
+#define APPLE_CALIB_MAX_POINTS 16
+#define APPLE_FAN_STATES 256
+
+// calibration sweep: rpm is polled every SWEEP_POLL_MS until it changed by at
+// most SWEEP_SETTLE_RPM for SWEEP_SETTLE_READS reads (or SWEEP_TIMEOUT_MS)
+#define SWEEP_POLL_MS 250
+#define SWEEP_SETTLE_RPM 50
+#define SWEEP_SETTLE_READS 3
+#define SWEEP_TIMEOUT_MS 15000
+// a sweep is only applied if the measured speed rose by SWEEP_MIN_SPAN_RPM
+// from the first to the last state and in at least SWEEP_MIN_RISES steps,
+// an SMC repeating a stale value would otherwise yield a flat table
+#define SWEEP_MIN_SPAN_RPM 500
+#define SWEEP_MIN_RISES ((APPLE_CALIB_MAX_POINTS - 1) / 2)
+
+// sensor sampler period (ms), adjustable through 'update_interval'
+// - 0 turns the sampler off, reads refresh on demand then
+#define UPDATE_INTERVAL_DEFAULT 1000
+#define UPDATE_INTERVAL_MIN 100
+#define UPDATE_INTERVAL_MAX 60000
+
+// in-kernel fan curve: max number of points and controller period (ms)
+#define APPLE_CURVE_MAX_POINTS 8
+// limits of the curve point temperatures (degree celsius)
+#define CURVE_TEMP_MIN -50
+#define CURVE_TEMP_MAX 150
+#define CURVE_INTERVAL_DEFAULT 1000
+#define CURVE_INTERVAL_MIN 100
+#define CURVE_INTERVAL_MAX 10000
+// limits of the curve hysteresis (degree celsius) and ramp (pwm per second)
+#define CURVE_HYST_MAX 50
+#define CURVE_RAMP_MAX 1000
+// EC write reduction: limits of fanX_slew (pwm/s) and fanX_deadband (pwm)
+// and the step period (ms) of slew-limited pwm stores
+#define FAN_SLEW_MAX 1000
+#define FAN_DEADBAND_MAX 32
+#define FAN_SLEW_PERIOD 250
+// fan_temp_ema is the weight of a reading per TEMP_EMA_PERIOD_MS, refreshes in
+// between (e.g. on-demand reads) advance the filter by their share of it
+#define TEMP_EMA_PERIOD_MS 1000
+
+// layout version of fanX_curve_table (see 'struct apple_fan_curve_table')
+#define APPLE_CURVE_TABLE_VERSION 1
+
+// cpu load feed-forward of the curve controller: utilization (percent) that
+// must persist 'lead' ms before the fans pre-spin
+#define FF_THRESHOLD_DEFAULT 50
+#define FF_LEAD_DEFAULT 2000
+#define FF_LEAD_MAX 60000
+
+// thermal zone polling periods (ms)
+#define THERMAL_POLLING_DELAY 2000
+#define THERMAL_PASSIVE_DELAY 1000
+// cooling states per fan, mapped linearly onto the fan state (0 - 255)
+#define APPLE_COOLING_STATES 10
+
+// simulated EC (backend=sim): fan speed range (RPM) and inertia (ms)
+#define SIM_RPM_MIN 1200
+#define SIM_RPM_MAX 6000
+#define SIM_FAN_TAU_MS 1500
+// ... thermal model: ambient (millidegree celsius), heat capacity (J/K) and
+// conductance (mW/K) without airflow / added by all fans at full speed
+#define SIM_AMBIENT 25000
+#define SIM_HEAT_CAPACITY 20
+#define SIM_CONDUCTANCE_MIN 500
+#define SIM_CONDUCTANCE_FAN 2500
+// ... integration step and max catch-up after idle periods (ms)
+#define SIM_STEP_MS 100
+#define SIM_MAX_CATCHUP_MS 60000
+
+// layout version and capacity of the debugfs 'snapshot' record
+#define APPLE_SNAPSHOT_VERSION 1
+#define APPLE_SNAPSHOT_MAX_FANS 8
+#define APPLE_SNAPSHOT_MAX_TEMPS 16
+
+// layout version of the telemetry ring (see 'struct apple_fan_ring_header')
+#define APPLE_RING_VERSION 2
+// default and max ring depth (records), the default covers ~7 min at the
+// minimal update_interval
+#define APPLE_RING_DEPTH_DEFAULT 4096
+#define APPLE_RING_DEPTH_MAX 65536
+// 'apple_fan_sample.flags': 'temp' holds a valid reading
+#define APPLE_SAMPLE_TEMP_VALID 0x1
+
+// circuit breaker of every acpi method: opens after BREAKER_THRESHOLD failures
+// in a row, retries after a backoff doubling from BREAKER_BACKOFF_MIN_MS up to
+// BREAKER_BACKOFF_MAX_MS
+#define BREAKER_THRESHOLD 3
+#define BREAKER_BACKOFF_MIN_MS 1000
+#define BREAKER_BACKOFF_MAX_MS 60000
+// status of calls refused by an open breaker
+#define AE_APPLE_BREAKER_OPEN AE_ABORT_METHOD
+
+// log2 latency histogram buckets: <1us, [1us, 2us), ... [2^22us, inf)
+#define APPLE_FAN_HIST_BUCKETS 24
+
+// dynamic debug callsite, a patched-out branch until enabled at runtime, e.g.
+// echo 'module t2fan_module +p' > /sys/kernel/debug/dynamic_debug/control
 #define dbg_msg(fmt, ...)                                                      \
   do {                                                                         \
-    printk(KERN_INFO "apple-fan (debug) - " fmt "\n", ##__VA_ARGS__);          \
+    pr_debug("apple-fan (debug) - " fmt "\n", ##__VA_ARGS__);                 \
   } while (0)
 
 #define info_msg(title, fmt, ...)                                              \
@@ -44,6 +195,8 @@
     printk(KERN_WARNING "apple-fan (" title ") - " fmt "\n", ##__VA_ARGS__);   \
   } while (0)
 
+struct apple_fan_data;
+
 struct apple_fan_driver {
   const char *name;
   struct module *owner;
@@ -58,53 +211,735 @@ struct apple_fan {
   struct platform_device *platform_device;
 
   struct apple_fan_driver *driver;
-  struct apple_fan_driver *driver_gfx;
 
   struct device *hwmon_dev;
+
+  // per-device state, also the drvdata of 'hwmon_dev'
+  struct apple_fan_data *data;
+};
+
+// acpi methods used by the driver, resolved once in apple_fan_probe()
+enum apple_fan_method {
+  // set fan speed (fan index + 1) or auto-mode (fan index 0)
+  APPLE_METHOD_SFNV,
+  // gfx temperature
+  APPLE_METHOD_TH1R,
+  // cpu temperature
+  APPLE_METHOD_TH0R,
+  // acpi thermal zones (0.1 kelvin), present on some models only
+  APPLE_METHOD_TZ_THRM,
+  APPLE_METHOD_TZ_TZ00,
+  APPLE_METHOD_TZ_TZ01,
+  // max fan speed
+  APPLE_METHOD_ST98,
+  // quiet mode (used to reset max fan speed)
+  APPLE_METHOD_QMOD,
+  // current fan speed (RPM) via SMC
+  APPLE_METHOD_SMC_RPM,
+  // number of fans via SMC, optional
+  APPLE_METHOD_SMC_FNUM,
+
+  APPLE_METHOD_COUNT
+};
+
+struct apple_fan_acpi_method {
+  // short name used for tracing and statistics
+  const char *name;
+  // absolute acpi path of the method
+  const char *path;
+  // cached handle, only valid if 'present' is set
+  acpi_handle handle;
+  // 'true' - if the method was found during probe
+  bool present;
+  // 'true' - never refused by the breaker (e.g. handing fans back)
+  bool critical;
+
+  // health of the method, protected by 'ec_lock'
+  // - failures in a row, the breaker is open at BREAKER_THRESHOLD
+  unsigned int failures;
+  // current retry backoff (ms), 0 while the method is healthy
+  unsigned int backoff_ms;
+  // jiffies of the next attempt while the breaker is open
+  unsigned long retry_at;
+  // how often the breaker opened
+  u64 trips;
+};
+
+// temperature sensor candidate, see 'apple_fan_temps'
+struct apple_fan_temp_desc {
+  // acpi method reading the sensor
+  enum apple_fan_method method;
+  // hwmon tempX_label
+  const char *label;
+  // hwmon tempX_crit (degree celsius)
+  int crit;
+  // 'true' - reports 0.1 kelvin (acpi _TMP), degree celsius otherwise
+  bool decikelvin;
+  // offset to the die temperature of the simulated EC (millidegree celsius)
+  int sim_offset;
+};
+
+// EC access, all ops are called with 'ec_lock' held
+struct apple_fan_backend {
+  // value of the 'backend' module parameter selecting this backend
+  const char *name;
+  // prepare 'data' for this backend (during probe)
+  void (*init)(struct apple_fan_data *data);
+  // set fan with index 'fan' to 'speed' (0 - 255), enables manual mode
+  acpi_status (*set_speed)(struct apple_fan_data *data, int fan, int speed);
+  // hand all fans back to the firmware
+  acpi_status (*set_auto)(struct apple_fan_data *data);
+  // measured speed (RPM) of fan with index 'fan'
+  // - not all firmwares follow manual speeds here, the driver reports the
+  //   calibrated speed in manual mode and the sweep verifies its readings
+  acpi_status (*read_rpm)(struct apple_fan_data *data, int fan,
+                          unsigned long long *rpm);
+  // number of fans the EC knows about
+  acpi_status (*read_fan_count)(struct apple_fan_data *data,
+                                unsigned long long *count);
+  // raw readout of temperature sensor 'desc' (unit see 'desc->decikelvin')
+  acpi_status (*read_temp)(struct apple_fan_data *data,
+                           const struct apple_fan_temp_desc *desc,
+                           unsigned long long *temp);
+  // max fan speed (0 - 255)
+  acpi_status (*set_max)(struct apple_fan_data *data, unsigned long state);
+  // quiet mode, 2 resets the max fan speed
+  acpi_status (*qmod)(struct apple_fan_data *data, int mode);
+};
+
+// state of the simulated EC, protected by 'ec_lock'
+struct apple_fan_sim {
+  // CLOCK_MONOTONIC time (ns) the model was advanced to
+  u64 last_ns;
+  // die temperature (millidegree celsius)
+  s64 temp;
+  // current fan speeds (RPM)
+  int rpm[APPLE_MAX_FANS];
+  // commanded fan speeds (0 - 255), -1 in auto-mode
+  int speed[APPLE_MAX_FANS];
+  // number of fans, see 'sim_fans'
+  int nr_fans;
+  // max fan speed setting (0 - 255)
+  int max_speed;
+  // per-device 'sim_latency_us' / 'sim_error_rate', -1 follows the parameter
+  int latency_us;
+  int error_rate;
+};
+
+// per-cpu call statistics of a single acpi method
+struct apple_fan_method_stats {
+  u64 calls;
+  u64 errors;
+  // accumulated evaluation time (ns)
+  u64 time_ns;
+  // evaluation latency histogram, see APPLE_FAN_HIST_BUCKETS
+  u64 hist[APPLE_FAN_HIST_BUCKETS];
+};
+
+struct apple_fan_stats {
+  struct apple_fan_method_stats methods[APPLE_METHOD_COUNT];
+};
+
+// record returned by a single read of debugfs 'snapshot'
+// - fixed layout, native endianness, only ever extended at the end
+// - 'version' changes on any incompatible change
+struct apple_fan_snapshot {
+  __u32 version;
+  // sizeof(struct apple_fan_snapshot)
+  __u32 size;
+  // CLOCK_MONOTONIC time of the sensor refresh (ns)
+  __u64 timestamp_ns;
+  // valid entries in 'fans' / 'temps'
+  __u32 nr_fans;
+  __u32 nr_temps;
+  // max fan speed setting (0 - 255)
+  __s32 max_fan_speed;
+  __u32 reserved;
+  struct {
+    // current speed (RPM), -1 if unavailable
+    __s32 rpm;
+    // current fan state/speed (0 - 255)
+    __s32 pwm;
+    // see 'enum apple_fan_mode'
+    __u32 mode;
+    // reported minimal speed
+    __s32 min;
+  } fans[APPLE_SNAPSHOT_MAX_FANS];
+  struct {
+    // millidegree celsius, only valid if 'status' is 0
+    __s32 temp;
+    __s32 crit;
+    // 0 or negative errno of the last read
+    __s32 status;
+    __u32 reserved;
+  } temps[APPLE_SNAPSHOT_MAX_TEMPS];
+};
+
+// first page of the /dev/apple_fan mapping, the records follow at PAGE_SIZE
+// - 'head' counts all records ever written, record 'i' lives at index
+//   'i & (nr_records - 1)'
+// - a consumer loads 'head' (acquire), copies the records it needs and
+//   re-checks 'head': records older than 'head - nr_records + 1' may have
+//   been overwritten in the meantime
+// - poll() reports readable while 'head' differs from the value returned by
+//   the last read(), which yields the current 'head' (__u64) and so
+//   acknowledges everything up to it
+struct apple_fan_ring_header {
+  __u32 version;
+  // sizeof(struct apple_fan_sample)
+  __u32 record_size;
+  // ring depth (power of two)
+  __u32 nr_records;
+  // valid entries in the per-fan arrays of every record
+  __u32 nr_fans;
+  __u64 head;
+};
+
+// one record of the telemetry ring, appended by the sampler - or by every
+// on-demand refresh while the sampler is off
+struct apple_fan_sample {
+  // CLOCK_MONOTONIC time of the sensor refresh (ns)
+  __u64 timestamp_ns;
+  // speed (RPM), -1 if unavailable
+  __s32 rpm[APPLE_MAX_FANS];
+  // fan state (0 - 255)
+  __s32 pwm[APPLE_MAX_FANS];
+  // millidegree celsius, see APPLE_SAMPLE_TEMP_VALID
+  __s32 temp;
+  // see 'enum apple_fan_mode'
+  __u8 mode[APPLE_MAX_FANS];
+  __u16 flags;
+};
+
+// telemetry ring, outlives the device while it is still opened/mapped
+struct apple_fan_ring {
+  struct kref kref;
+  // vmalloc_user()'d header page followed by the records
+  void *buf;
+  size_t size;
+  struct apple_fan_ring_header *hdr;
+  struct apple_fan_sample *records;
+  // woken up for every appended record
+  wait_queue_head_t wait;
+};
+
+// who controls the fan speed, see 'enum apple_pwm_enable' for pwmX_enable
+enum apple_fan_mode {
+  // firmware (EC) controls the fan
+  APPLE_FAN_MODE_AUTO,
+  // speed is set through pwmX / fanX_speed
+  APPLE_FAN_MODE_MANUAL,
+  // speed follows the in-kernel fan curve
+  APPLE_FAN_MODE_CURVE,
+};
+
+// pwmX_enable values as defined by the hwmon sysfs ABI
+// - 0 (no control / full speed) is not supported and rejected
+enum apple_pwm_enable {
+  APPLE_PWM_ENABLE_FULL,
+  APPLE_PWM_ENABLE_MANUAL,
+  // automatic: firmware (EC) control or the in-kernel fan curve
+  APPLE_PWM_ENABLE_FIRMWARE,
+  APPLE_PWM_ENABLE_CURVE,
+};
+
+// changes delivered to userspace via sysfs_notify()/uevents (see
+// apple_fan_notify()), used as bit numbers in 'apple_fan_data.events'
+enum apple_fan_event {
+  APPLE_EVENT_TEMP1_MAX_ALARM,
+  APPLE_EVENT_TEMP1_CRIT_ALARM,
+  // fan stalled, one bit per fan
+  APPLE_EVENT_FAN1_ALARM,
+  // mode transition, one bit per fan
+  APPLE_EVENT_FAN1_MODE = APPLE_EVENT_FAN1_ALARM + APPLE_MAX_FANS,
+};
+
+struct apple_fan_curve_point {
+  // temperature (degree celsius)
+  int temp;
+  // fan state/speed (0 - 255) at 'temp'
+  int pwm;
+};
+
+// measured speed (RPM) at one fan state
+struct apple_fan_calib_point {
+  int pwm;
+  int rpm;
+};
+
+// piecewise-linear fan state -> RPM calibration of one fan
+// - no points: use the FAN_FIT_* fit
+// - outside of the points the first/last speed is kept
+struct apple_fan_calib {
+  int npoints;
+  struct apple_fan_calib_point points[APPLE_CALIB_MAX_POINTS];
+};
+
+enum apple_fan_sweep_status {
+  APPLE_SWEEP_IDLE,
+  APPLE_SWEEP_RUNNING,
+  APPLE_SWEEP_DONE,
+  APPLE_SWEEP_FAILED,
+  APPLE_SWEEP_ABORTED,
+};
+
+// applies the pwm stores of one fan, waits FAN_SLEW_PERIOD between the steps
+// of a slew-limited setpoint
+struct apple_fan_speed {
+  struct apple_fan_data *data;
+  // fan index
+  int fan;
+  struct delayed_work work;
+};
+
+// calibration sweep of one fan, steps through APPLE_CALIB_MAX_POINTS states
+// - protected by 'apple_fan_data.sweep_lock'
+struct apple_fan_sweep {
+  struct apple_fan_data *data;
+  int fan;
+  enum apple_fan_sweep_status status;
+  // index of the state currently settling
+  int step;
+  // mode/state to restore afterwards
+  enum apple_fan_mode saved_mode;
+  int saved_state;
+  // last measured speed and number of reads within SWEEP_SETTLE_RPM
+  int last_rpm;
+  int stable;
+  // jiffies after which the current step is taken as is
+  unsigned long deadline;
+  // measured result, applied once the sweep is done
+  struct apple_fan_calib calib;
+  struct delayed_work work;
+};
+
+// piecewise-linear temperature -> pwm mapping used in curve mode
+// - published through rcu, never modified once published
+struct apple_fan_curve {
+  int npoints;
+  // sorted by ascending temperature
+  struct apple_fan_curve_point points[APPLE_CURVE_MAX_POINTS];
+  // the fan only slows down once the temperature dropped this far (degree
+  // celsius) below the point that raised it
+  int hysteresis;
+  // pwm added on top of the curve at full (sustained) cpu load, 0 = off
+  int ff_gain;
+  // max change of the fan state per second (pwm/s), 0 = unlimited
+  int ramp;
+  // temperature sensor (index of tempN - 1) the curve follows
+  int sensor;
+  struct rcu_head rcu;
+};
+
+// fanX_curve_table: a whole curve in a single read or write
+// - fixed layout, native endianness
+// - 'version' changes on any incompatible change
+struct apple_fan_curve_table {
+  __u32 version;
+  // valid entries in 'points' (1 - APPLE_CURVE_MAX_POINTS)
+  __u32 npoints;
+  struct {
+    // degree celsius, strictly ascending
+    __s32 temp;
+    // fan state/speed (0 - 255)
+    __s32 pwm;
+  } points[APPLE_CURVE_MAX_POINTS];
+  // see 'struct apple_fan_curve'
+  __u32 hysteresis;
+  __u32 ff_gain;
+  __u32 ramp;
+  __u32 sensor;
+};
+
+// cpu load feed-forward of the curve controller, owned by the controller
+// - 'offset' is written under 'ec_lock', the configuration with WRITE_ONCE()
+struct apple_fan_load {
+  // summed up idle and wall time (us) of the online cpus at the last sample
+  u64 idle;
+  u64 wall;
+  // utilization (percent) of the last interval, scaled by cpufreq
+  int util;
+  // jiffies when 'util' rose above 'threshold' (0 = below)
+  unsigned long since;
+  // feed-forward share of each fan's state applied by the last controller run
+  int offset[APPLE_MAX_FANS];
+  // configuration through fan_ff_threshold / fan_ff_lead
+  unsigned int threshold;
+  unsigned int lead_ms;
+};
+
+// speed write counters of one fan, see debugfs 'writes'
+struct apple_fan_writes {
+  // EC round-trips
+  u64 applied;
+  // dropped, the fan already runs at the requested state
+  u64 unchanged;
+  // dropped, the change was within the deadband
+  u64 deadband;
+  // cut short by the slew limit, the rest follows later
+  u64 slewed;
+};
+
+// platform_profile preset, applied to every fan in one go
+struct apple_fan_profile {
+  // ST98 max speed, 255 restores the EC default through QMOD
+  int max_speed;
+  int minimum;
+  struct apple_fan_curve curve;
+};
+
+// thermal cooling device wrapping one fan
+struct apple_fan_cooling {
+  struct apple_fan_data *data;
+  // fan index
+  int fan;
+  // 'true' - while the thermal framework drives this fan (incl. holding it at
+  // its minimum for state 0)
+  bool active;
+  // last state set by the governor, reported back while 'active'
+  unsigned long state;
+  char name[THERMAL_NAME_LENGTH];
+  struct thermal_cooling_device *cdev;
 };
 
 struct apple_fan_data {
   struct apple_fan *apple_fan_obj;
 
+  // EC implementation selected by the 'backend' module parameter
+  const struct apple_fan_backend *backend;
+  // simulated EC, only used with 'backend=sim'
+  struct apple_fan_sim sim;
+
+  // serializes every EC round-trip together with the state change it applies
+  // - lock order: 'curve_lock' / 'update_lock' before 'ec_lock'
+  struct mutex ec_lock;
+  // publishes 'fan_states', 'fan_mode' and 'max_fan_speed_setting' to
+  // readers, which never wait for the EC (writers also hold 'ec_lock')
+  seqlock_t state_lock;
+
+  // number of fans found during probe, every per-fan array below is indexed
+  // by channel (fan index) and only valid below 'nr_fans'
+  int nr_fans;
+
+  // calibration of every fan and the RPM per state built from it
+  // - 'rpm_table' is monotonic, written under 'ec_lock' and 'state_lock'
+  struct apple_fan_calib calib[APPLE_MAX_FANS];
+  int rpm_table[APPLE_MAX_FANS][APPLE_FAN_STATES];
+
   // 'fan_states' save last (manually) set fan state/speed
-  int fan_states[2];
-  // 'fan_manual_mode' keeps whether this fan is manually controlled
-  bool fan_manual_mode[2];
-  // 'true' - if first fan is available
-  bool has_fan;
-  // 'true' - if second fan is available
-  bool has_gfx_fan;
+  int fan_states[APPLE_MAX_FANS];
+  // 'fan_mode' keeps who controls this fan (auto, manual or curve)
+  enum apple_fan_mode fan_mode[APPLE_MAX_FANS];
   // max fan speed default
   int max_fan_speed_default;
   // ... user-defined max value
   int max_fan_speed_setting;
-  // minimum allowed (set) speed for fan(s)
-  int fan_minimum;
-  // this speed will be reported as the minimal speed for the fans
-  int fan_minimum_gfx;
-  // regular fan name
-  const char *fan_desc;
-  // gfx-card fan name
-  const char *gfx_fan_desc;
+  // minimum allowed (set) speed, also reported as fanX_min
+  int fan_minimum[APPLE_MAX_FANS];
+  // fan names (fanX_label)
+  const char *fan_desc[APPLE_MAX_FANS];
+  // acpi method table (see 'enum apple_fan_method')
+  struct apple_fan_acpi_method methods[APPLE_METHOD_COUNT];
+
+  // serializes sensor refreshes (EC round-trips) of the sampler and readers
+  struct mutex update_lock;
+  // 'true' - once the cached sensor values below were read
+  bool valid;
+  // bumped under 'ec_lock' by every change the cached values don't reflect
+  // yet (mode, state, calibration)
+  unsigned long ec_gen;
+  // 'ec_gen' as of the EC reads behind the cached values, the cache is stale
+  // as soon as they differ
+  unsigned long cached_gen;
+  // jiffies of the last sensor refresh
+  unsigned long last_updated;
+  // incremented by every refresh, lets waiting readers share it
+  unsigned long update_gen;
+  // same per fan/sensor, also incremented by refreshes of that one alone
+  unsigned long fan_rpm_gen[APPLE_MAX_FANS];
+  unsigned long temp_gen[APPLE_MAX_TEMPS];
+  // CLOCK_MONOTONIC time (ns) of the last sensor refresh
+  u64 last_updated_ns;
+  // cached fan speeds (RPM), -1 if the last readout failed
+  int fan_rpm[APPLE_MAX_FANS];
+  // acpi status of the last speed readout of each fan
+  acpi_status fan_rpm_status[APPLE_MAX_FANS];
+  // sensors found during probe, index i is exposed as temp(i+1)
+  // - index 0 is always TH1R, the input of the thermal zone and the default
+  //   input of the curves
+  const struct apple_fan_temp_desc *temp_desc[APPLE_MAX_TEMPS];
+  int nr_temps;
+  // cached temperatures (millidegree celsius)
+  long temp[APPLE_MAX_TEMPS];
+  // acpi status of the last read of each sensor
+  acpi_status temp_status[APPLE_MAX_TEMPS];
+  // 'temp' smoothed by an exponential moving average, input of the curves
+  long temp_filtered[APPLE_MAX_TEMPS];
+  // CLOCK_MONOTONIC time (ns) of the last read of each sensor
+  u64 temp_updated_ns[APPLE_MAX_TEMPS];
+  // weight (percent) of the readings of one TEMP_EMA_PERIOD_MS in
+  // 'temp_filtered', 100 = off
+  unsigned int temp_ema;
+  // background sensor sampler
+  struct delayed_work sampler;
+  // sampler period in ms, 0 if the sampler is off
+  unsigned long update_interval;
+
+  // temp1 alarm threshold (millidegree celsius), adjustable through temp1_max
+  long temp1_max;
+  // alarm states as of the last sensor refresh (protected by 'update_lock')
+  bool temp1_max_alarm;
+  bool temp1_crit_alarm;
+  bool fan_alarm[APPLE_MAX_FANS];
+  // pending 'enum apple_fan_event' bits not yet delivered to userspace
+  unsigned long events;
+
+  // telemetry ring (NULL if disabled), see __apple_fan_ring_push()
+  struct apple_fan_ring *ring;
+  // /dev/apple_fan exposing 'ring'
+  struct miscdevice ring_dev;
+
+  // acpi call statistics (per-cpu, summed up on read)
+  struct apple_fan_stats __percpu *stats;
+  // debugfs directory holding the statistics
+  struct dentry *debugfs;
+
+  // serializes curve updates (sysfs, platform_profile)
+  struct mutex curve_lock;
+  // fan curves used in curve mode, read under rcu and replaced as a whole
+  // under 'curve_lock' (the controller never waits for an update)
+  struct apple_fan_curve __rcu *fan_curve[APPLE_MAX_FANS];
+  // pre-spins the fans in curve mode on sustained cpu load
+  struct apple_fan_load load;
+  // closed-loop controller, runs while any fan is in curve mode
+  struct delayed_work controller;
+
+  // calibration sweeps, 'sweep_lock' is taken before 'update_lock'/'ec_lock'
+  struct mutex sweep_lock;
+  struct apple_fan_sweep sweep[APPLE_MAX_FANS];
+
+  // EC discovery and registration after probe, see apple_fan_init_work()
+  struct work_struct init_work;
+  // 'true' - once 'init_work' published the device (hwmon & co.)
+  bool ready;
+
+  // pwm stores only record the setpoint, 'speed[fan]' applies it later
+  // - 'wq' is ordered and runs 'init_work' first
+  // - one work per fan, a slew step of one fan never holds up another one
+  struct workqueue_struct *wq;
+  struct apple_fan_speed speed[APPLE_MAX_FANS];
+  // latest requested speed not yet applied (-1 = none), taken with xchg()
+  int pending_speed[APPLE_MAX_FANS];
+  // first error of an asynchronous write since the last flush (acpi status)
+  acpi_status speed_err;
+
+  // EC write reduction of manual stores and the curve controller, written
+  // through sysfs with WRITE_ONCE()
+  // - 'fan_slew': max change of the fan state per second (pwm/s), 0 = off
+  // - 'fan_deadband': smaller changes are dropped (pwm), 0 = off
+  unsigned int fan_slew[APPLE_MAX_FANS];
+  unsigned int fan_deadband[APPLE_MAX_FANS];
+  // state a slew-limited fan is moving towards, protected by 'ec_lock'
+  // - -1 after mode changes and direct writes, nothing is in flight then
+  int fan_target[APPLE_MAX_FANS];
+  // speed writes of every fan, protected by 'ec_lock'
+  struct apple_fan_writes writes[APPLE_MAX_FANS];
+
+  // fans as thermal cooling devices
+  struct apple_fan_cooling cooling[APPLE_MAX_FANS];
+  // TH1R as thermal zone
+  struct thermal_zone_device *tz;
+
+  // platform_profile, only one handler can exist system-wide
+  struct platform_profile_handler profile_handler;
+  bool profile_registered;
+  // last applied profile, protected by 'curve_lock'
+  enum platform_profile_option profile;
 };
 
 /*
  *  GLOBALS.........
  * */
 
-static struct apple_fan_data apple_data = {
-    NULL, {-1, -1}, {false, false}, false,    false, 255, 255,
-    10,   10,       "CPU Fan",      "GFX Fan"};
+// initial state of every probed device
+static const struct apple_fan_data apple_data_defaults = {
+    .apple_fan_obj = NULL,
+    .fan_states = {[0 ... APPLE_MAX_FANS - 1] = -1},
+    .pending_speed = {[0 ... APPLE_MAX_FANS - 1] = -1},
+    .fan_target = {[0 ... APPLE_MAX_FANS - 1] = -1},
+    .temp_ema = 100,
+    .fan_mode = {[0 ... APPLE_MAX_FANS - 1] = APPLE_FAN_MODE_AUTO},
+    .max_fan_speed_default = 255,
+    .max_fan_speed_setting = 255,
+    .fan_minimum = {[0 ... APPLE_MAX_FANS - 1] = 10},
+    .fan_desc = {"CPU Fan", "GFX Fan", "Fan 3", "Fan 4"},
+    .update_interval = UPDATE_INTERVAL_DEFAULT,
+    .temp1_max = TEMP1_MAX_DEFAULT * 1000,
+    .load = {.threshold = FF_THRESHOLD_DEFAULT, .lead_ms = FF_LEAD_DEFAULT},
+    .profile = PLATFORM_PROFILE_BALANCED,
+    .methods = {
+        [APPLE_METHOD_SFNV] = {.name = "SFNV",
+                               .path = "\\_SB.PCI0.LPCB.EC0.SFNV",
+                               .critical = true},
+        [APPLE_METHOD_TH1R] = {.name = "TH1R",
+                               .path = "\\_SB.PCI0.LPCB.EC0.TH1R"},
+        [APPLE_METHOD_TH0R] = {.name = "TH0R",
+                               .path = "\\_SB.PCI0.LPCB.EC0.TH0R"},
+        [APPLE_METHOD_TZ_THRM] = {.name = "THRM", .path = "\\_TZ.THRM._TMP"},
+        [APPLE_METHOD_TZ_TZ00] = {.name = "TZ00", .path = "\\_TZ.TZ00._TMP"},
+        [APPLE_METHOD_TZ_TZ01] = {.name = "TZ01", .path = "\\_TZ.TZ01._TMP"},
+        [APPLE_METHOD_ST98] = {.name = "ST98",
+                               .path = "\\_SB.PCI0.LPCB.EC0.ST98"},
+        [APPLE_METHOD_QMOD] = {.name = "QMOD", .path = "\\_SB.ATKD.QMOD"},
+        [APPLE_METHOD_SMC_RPM] = {.name = "SMC_",
+                                  .path = "\\_SB_.PCI0.LPCB.SMC_"},
+        [APPLE_METHOD_SMC_FNUM] = {.name = "FNUM",
+                                   .path = "\\_SB_.PCI0.LPCB.FNUM"},
+    }};
 
 const static char *fan_mode_manual_string = "manual";
 const static char *fan_mode_auto_string = "auto";
+const static char *fan_mode_curve_string = "curve";
+
+// max age (ms) of cached sensor values before a read refreshes them itself
+static unsigned int max_age;
+module_param(max_age, uint, 0644);
+MODULE_PARM_DESC(max_age, "Force a synchronous sensor refresh on read if the "
+                          "cached values are older than this (ms, 0 = off)");
+// initial sensor sampler period (ms), see 'update_interval' in hwmon
+static unsigned int update_interval = UPDATE_INTERVAL_DEFAULT;
+module_param(update_interval, uint, 0444);
+MODULE_PARM_DESC(update_interval, "Sensor sampler period (ms, 0 = no sampler, "
+                                  "every read refreshes)");
+// period (ms) of the in-kernel fan curve controller
+// - bounded, 0 would requeue the controller without delay and round the ramp
+//   step down to nothing
+static unsigned int curve_interval = CURVE_INTERVAL_DEFAULT;
+static int curve_interval_set(const char *val, const struct kernel_param *kp) {
+  return param_set_uint_minmax(val, kp, CURVE_INTERVAL_MIN,
+                               CURVE_INTERVAL_MAX);
+}
+static const struct kernel_param_ops curve_interval_ops = {
+    .set = curve_interval_set,
+    .get = param_get_uint,
+};
+module_param_cb(curve_interval, &curve_interval_ops, &curve_interval, 0644);
+MODULE_PARM_DESC(curve_interval,
+                 "Period of the fan curve controller (ms, 100 - 10000)");
+// EC backend, 'sim' runs the driver against a simulated EC (no apple hardware)
+static char *backend = "acpi";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "EC backend: 'acpi' (default) or 'sim'");
+// simulated EC: heat load, latency and error rate of every EC call
+static unsigned int sim_load = 15;
+module_param(sim_load, uint, 0644);
+MODULE_PARM_DESC(sim_load, "Simulated EC: heat load (W)");
+static unsigned int sim_latency_us = 200;
+module_param(sim_latency_us, uint, 0644);
+MODULE_PARM_DESC(sim_latency_us, "Simulated EC: latency of each call (us)");
+static unsigned int sim_error_rate;
+module_param(sim_error_rate, uint, 0644);
+MODULE_PARM_DESC(sim_error_rate,
+                 "Simulated EC: share of failing calls (per mille)");
+static unsigned int sim_fans = APPLE_FANS_DEFAULT;
+module_param(sim_fans, uint, 0444);
+MODULE_PARM_DESC(sim_fans, "Simulated EC: number of fans (1 - 4)");
+// calibrations applied during probe (see fanX_calibration), overriding the
+// built-in ones - e.g. results of a calibration sweep, spaces or commas
+static char *fan1_calibration;
+module_param(fan1_calibration, charp, 0444);
+MODULE_PARM_DESC(fan1_calibration, "Calibration of fan 1 as \"pwm:rpm,...\"");
+static char *fan2_calibration;
+module_param(fan2_calibration, charp, 0444);
+MODULE_PARM_DESC(fan2_calibration, "Calibration of fan 2 as \"pwm:rpm,...\"");
+static char *fan3_calibration;
+module_param(fan3_calibration, charp, 0444);
+MODULE_PARM_DESC(fan3_calibration, "Calibration of fan 3 as \"pwm:rpm,...\"");
+static char *fan4_calibration;
+module_param(fan4_calibration, charp, 0444);
+MODULE_PARM_DESC(fan4_calibration, "Calibration of fan 4 as \"pwm:rpm,...\"");
+// depth of the telemetry ring (records), one record per sensor refresh
+// - bounded, larger values overflow the rounding to a power of two
+static unsigned int ring_depth = APPLE_RING_DEPTH_DEFAULT;
+static int ring_depth_set(const char *val, const struct kernel_param *kp) {
+  return param_set_uint_minmax(val, kp, 0, APPLE_RING_DEPTH_MAX);
+}
+static const struct kernel_param_ops ring_depth_ops = {
+    .set = ring_depth_set,
+    .get = param_get_uint,
+};
+module_param_cb(ring_depth, &ring_depth_ops, &ring_depth, 0444);
+MODULE_PARM_DESC(ring_depth,
+                 "Telemetry ring depth in records (0 = off, max 65536)");
+// register fans and temperature with the kernel thermal framework
+static bool thermal = true;
+module_param(thermal, bool, 0444);
+MODULE_PARM_DESC(thermal, "Register cooling devices and a thermal zone");
+
+// trip points of the TH1R thermal zone (millidegree celsius)
+// - TEMP1_CRIT is a 'hot' trip, shutting down is left to the firmware
+static const struct thermal_trip apple_fan_trips[] = {
+    {.temperature = (TEMP1_CRIT - 40) * 1000,
+     .hysteresis = 2000,
+     .type = THERMAL_TRIP_ACTIVE},
+    {.temperature = (TEMP1_CRIT - 20) * 1000,
+     .hysteresis = 2000,
+     .type = THERMAL_TRIP_PASSIVE},
+    {.temperature = TEMP1_CRIT * 1000, .type = THERMAL_TRIP_HOT},
+};
+
+// platform_profile presets, 'balanced' matches the driver defaults
+static const struct apple_fan_profile apple_fan_profiles[] = {
+    [PLATFORM_PROFILE_LOW_POWER] = {.max_speed = 180,
+                                    .minimum = 10,
+                                    .curve = {.npoints = 4,
+                                              .points = {{50, 40},
+                                                         {65, 80},
+                                                         {80, 140},
+                                                         {90, 180}},
+                                              .hysteresis = 4}},
+    [PLATFORM_PROFILE_BALANCED] = {.max_speed = 255,
+                                   .minimum = 10,
+                                   .curve = {.npoints = 4,
+                                             .points = {{40, 60},
+                                                        {55, 100},
+                                                        {70, 170},
+                                                        {85, 255}},
+                                             .hysteresis = 3}},
+    [PLATFORM_PROFILE_PERFORMANCE] = {.max_speed = 255,
+                                      .minimum = 60,
+                                      .curve = {.npoints = 4,
+                                                .points = {{35, 100},
+                                                           {50, 150},
+                                                           {65, 220},
+                                                           {75, 255}},
+                                                .hysteresis = 2}},
+};
 
-// params struct used frequently for acpi-call-construction
-static struct acpi_object_list params;
-// force loading i.e., skip device existance check
-static short force_load = false;
-// allow checking but override rpm check
-static short force_rpm_override = false;
+// temperature sensors probed in this order, missing or implausible ones are
+// skipped (TH1R is always exposed as temp1)
+static const struct apple_fan_temp_desc apple_fan_temps[] = {
+    {.method = APPLE_METHOD_TH1R, .label = TEMP1_LABEL, .crit = TEMP1_CRIT},
+    {.method = APPLE_METHOD_TH0R,
+     .label = "cpu_temp",
+     .crit = TEMP_CRIT_DEFAULT,
+     .sim_offset = 6000},
+    {.method = APPLE_METHOD_TZ_THRM,
+     .label = "acpi_thrm",
+     .crit = TEMP_CRIT_DEFAULT,
+     .decikelvin = true,
+     .sim_offset = -4000},
+    {.method = APPLE_METHOD_TZ_TZ00,
+     .label = "acpi_tz00",
+     .crit = TEMP_CRIT_DEFAULT,
+     .decikelvin = true,
+     .sim_offset = -9000},
+    {.method = APPLE_METHOD_TZ_TZ01,
+     .label = "acpi_tz01",
+     .crit = TEMP_CRIT_DEFAULT,
+     .decikelvin = true,
+     .sim_offset = -15000},
+};
 
 // housekeeping structs
 static struct apple_fan_driver apple_fan_driver = {
@@ -118,120 +953,449 @@ static struct attribute *platform_attributes[] = {NULL};
 static struct attribute_group platform_attribute_group = {
     .attrs = platform_attributes};
 
-// hidden fan api funcs used for both (wrap into them)
-static int __fan_get_cur_state(int fan, unsigned long *state);
-static int __fan_set_cur_state(int fan, unsigned long state);
-
-// get current mode (auto, manual, perhaps auto mode of module in future)
-static int __fan_get_cur_control_state(int fan, int *state);
-// switch between modes (auto, manual, perhaps auto mode of module in future)
-static int __fan_set_cur_control_state(int fan, int state);
-
-// regular fan api funcs
-static ssize_t fan_get_cur_state(struct device *dev,
-                                 struct device_attribute *attr, char *buf);
-static ssize_t fan_set_cur_state(struct device *dev,
-                                 struct device_attribute *attr, const char *buf,
-                                 size_t count);
-
-// gfx fan api funcs
-static ssize_t fan_get_cur_state_gfx(struct device *dev,
-                                     struct device_attribute *attr, char *buf);
-static ssize_t fan_set_cur_state_gfx(struct device *dev,
-                                     struct device_attribute *attr,
-                                     const char *buf, size_t count);
-
-// regular fan api funcs
-static ssize_t fan_get_cur_control_state(struct device *dev,
-                                         struct device_attribute *attr,
-                                         char *buf);
-static ssize_t fan_set_cur_control_state(struct device *dev,
-                                         struct device_attribute *attr,
-                                         const char *buf, size_t count);
-
-// gfx fan api funcs
-static ssize_t fan_get_cur_control_state_gfx(struct device *dev,
-                                             struct device_attribute *attr,
-                                             char *buf);
-static ssize_t fan_set_cur_control_state_gfx(struct device *dev,
-                                             struct device_attribute *attr,
-                                             const char *buf, size_t count);
-
-static ssize_t _fan_set_mode(int fan, const char *buf, size_t count);
-
-// gfx fan api funcs
-static ssize_t fan1_get_mode(struct device *dev, struct device_attribute *attr,
+// resolve all acpi methods of 'data->methods' into cached handles
+static void apple_fan_resolve_methods(struct apple_fan_data *data);
+
+// evaluate 'method' through its cached handle, caller must hold 'ec_lock'
+static acpi_status apple_fan_evaluate(struct apple_fan_data *data,
+                                      enum apple_fan_method method,
+                                      struct acpi_object_list *args,
+                                      unsigned long long *value);
+
+// EC backends (see 'struct apple_fan_backend')
+static const struct apple_fan_backend *apple_fan_find_backend(const char *name);
+
+static acpi_status apple_acpi_set_speed(struct apple_fan_data *data, int fan,
+                                        int speed);
+static acpi_status apple_acpi_set_auto(struct apple_fan_data *data);
+static acpi_status apple_acpi_read_rpm(struct apple_fan_data *data, int fan,
+                                       unsigned long long *rpm);
+static acpi_status apple_acpi_read_fan_count(struct apple_fan_data *data,
+                                             unsigned long long *count);
+static acpi_status apple_acpi_read_temp(struct apple_fan_data *data,
+                                        const struct apple_fan_temp_desc *desc,
+                                        unsigned long long *temp);
+static acpi_status apple_acpi_set_max(struct apple_fan_data *data,
+                                      unsigned long state);
+static acpi_status apple_acpi_qmod(struct apple_fan_data *data, int mode);
+
+// simulated EC: fan inertia and a thermal mass heated by 'sim_load'
+static void apple_sim_init(struct apple_fan_data *data);
+// advance the model to now
+static void apple_sim_step(struct apple_fan_data *data);
+// emulate one EC round-trip (latency, errors, tracing and statistics)
+static acpi_status apple_sim_eval(struct apple_fan_data *data,
+                                  enum apple_fan_method method, u32 nargs,
+                                  u64 arg0, u64 arg1, u64 value);
+static acpi_status apple_sim_set_speed(struct apple_fan_data *data, int fan,
+                                       int speed);
+static acpi_status apple_sim_set_auto(struct apple_fan_data *data);
+static acpi_status apple_sim_read_rpm(struct apple_fan_data *data, int fan,
+                                      unsigned long long *rpm);
+static acpi_status apple_sim_read_fan_count(struct apple_fan_data *data,
+                                            unsigned long long *count);
+static acpi_status apple_sim_read_temp(struct apple_fan_data *data,
+                                       const struct apple_fan_temp_desc *desc,
+                                       unsigned long long *temp);
+static acpi_status apple_sim_set_max(struct apple_fan_data *data,
+                                     unsigned long state);
+static acpi_status apple_sim_qmod(struct apple_fan_data *data, int mode);
+
+// circuit breaker, caller must hold 'ec_lock'
+// - 'true' - if calls to 'method' are to be refused right now
+static bool apple_fan_breaker_open(struct apple_fan_data *data,
+                                   enum apple_fan_method method);
+// - update the health of 'method' after a call returned 'ret'
+static void apple_fan_breaker_record(struct apple_fan_data *data,
+                                     enum apple_fan_method method,
+                                     acpi_status ret);
+// - close the breaker of 'method' and forget its failures
+static void apple_fan_breaker_reset(struct apple_fan_data *data,
+                                    enum apple_fan_method method);
+// - errno for a failed read: -ENODATA if the method is missing or its breaker
+//   is open, -EIO otherwise
+static int apple_fan_errno(acpi_status ret);
+
+// record one evaluation of 'method' in the per-cpu statistics
+static void apple_fan_account(struct apple_fan_data *data,
+                              enum apple_fan_method method, acpi_status ret,
+                              u64 duration);
+
+// debugfs: acpi call counts, errors and latency histograms
+static int apple_fan_stats_show(struct seq_file *s, void *unused);
+// debugfs: circuit breaker state of every method
+static int apple_fan_health_show(struct seq_file *s, void *unused);
+
+// debugfs: applied and dropped speed writes of every fan
+static int apple_fan_writes_show(struct seq_file *s, void *unused);
+
+// debugfs: coherent binary snapshot of all sensors and settings
+static void apple_fan_fill_snapshot(struct apple_fan_data *data,
+                                    struct apple_fan_snapshot *snap);
+static int apple_fan_snapshot_open(struct inode *inode, struct file *file);
+static ssize_t apple_fan_snapshot_read(struct file *file, char __user *buf,
+                                       size_t count, loff_t *ppos);
+static int apple_fan_snapshot_release(struct inode *inode, struct file *file);
+static void apple_fan_debugfs_init(struct apple_fan_data *data);
+
+// refresh all cached sensor values, caller must hold 'update_lock'
+static void __apple_fan_update(struct apple_fan_data *data);
+// refresh the cached speed of 'fan' / the reading of sensor 'i' (and advance
+// its filter), caller must hold 'update_lock' and 'ec_lock'
+static void __apple_fan_update_fan(struct apple_fan_data *data, int fan);
+static void __apple_fan_update_temp(struct apple_fan_data *data, int i,
+                                    u64 now);
+// weight (per mille) of a reading taken 'elapsed_ns' after the last one in
+// the filtered temperature, 'ema' percent per TEMP_EMA_PERIOD_MS
+static unsigned int apple_fan_ema_weight(unsigned int ema, u64 elapsed_ns);
+
+// 'true' - if the cached sensor values are invalid or older than 'age' ms
+static bool apple_fan_is_stale(struct apple_fan_data *data, unsigned int age);
+// mark the cached sensor values as outdated by an EC change, caller must hold
+// 'ec_lock'
+static void __apple_fan_invalidate(struct apple_fan_data *data);
+
+// refresh the cached speed of 'fan' / the reading of sensor 'i' unless a
+// refresh of it completes while waiting for 'update_lock', whose result is
+// shared instead (single-flight)
+static void apple_fan_update_fan(struct apple_fan_data *data, int fan);
+static void apple_fan_update_temp(struct apple_fan_data *data, int i);
+
+// refresh what a read of fan 'fan' / sensor 'i' returns if it is invalid or
+// too old, without the sampler (and 'max_age') only that one is read
+static void apple_fan_update_fan_if_stale(struct apple_fan_data *data,
+                                          int fan);
+static void apple_fan_update_temp_if_stale(struct apple_fan_data *data, int i);
+
+// re-evaluate all alarms from the cached values, caller must hold
+// 'update_lock'
+static void __apple_fan_check_alarms(struct apple_fan_data *data);
+// - only the temp1 alarms / only the alarm of 'fan'
+static void __apple_fan_check_temp_alarms(struct apple_fan_data *data);
+static void __apple_fan_check_fan_alarm(struct apple_fan_data *data, int fan);
+
+// deliver pending events, i.e. wake up poll() on the affected attributes
+// - must not be called with 'update_lock' held
+static void apple_fan_notify(struct apple_fan_data *data);
+
+// switch 'fan' to 'mode', trace it and queue an event if it changed
+// - caller must hold 'ec_lock' and 'state_lock' (write)
+static void apple_fan_switch_mode(struct apple_fan_data *data, int fan,
+                                  enum apple_fan_mode mode);
+
+// periodic sensor refresh, rescheduled every 'update_interval' ms
+static void apple_fan_sampler_work(struct work_struct *work);
+
+// telemetry ring: allocation, the producer side and /dev/apple_fan
+static int apple_fan_ring_init(struct apple_fan_data *data);
+static void apple_fan_ring_exit(struct apple_fan_data *data);
+static void apple_fan_ring_release(struct kref *kref);
+// append the current cached values as of 'timestamp_ns', caller must hold
+// 'update_lock'
+static void __apple_fan_ring_push(struct apple_fan_data *data,
+                                  u64 timestamp_ns);
+// same, but only while the sampler is off and on-demand refreshes are the
+// only ones feeding the ring
+static void __apple_fan_ring_push_on_demand(struct apple_fan_data *data,
+                                            u64 timestamp_ns);
+static int apple_fan_ring_open(struct inode *inode, struct file *file);
+static int apple_fan_ring_close(struct inode *inode, struct file *file);
+static int apple_fan_ring_mmap(struct file *file, struct vm_area_struct *vma);
+static ssize_t apple_fan_ring_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos);
+static __poll_t apple_fan_ring_poll(struct file *file, poll_table *wait);
+
+// evaluate 'curve' at 'temp' (degree celsius)
+static int apple_fan_curve_eval(const struct apple_fan_curve *curve, int temp);
+
+// next fan state in curve mode, 'cur' is the currently applied state
+static int apple_fan_curve_target(const struct apple_fan_curve *curve,
+                                  int temp, int cur);
+
+// 'balanced' curve for every fan (during probe), freed on remove
+static int apple_fan_curves_init(struct apple_fan_data *data);
+static void apple_fan_curves_free(struct apple_fan_data *data);
+// copy of the active curve of 'fan' to modify and publish, NULL if out of
+// memory, caller must hold 'curve_lock'
+static struct apple_fan_curve *apple_fan_curve_dup(struct apple_fan_data *data,
+                                                   int fan);
+// make 'curve' the active curve of 'fan', caller must hold 'curve_lock'
+static void apple_fan_curve_publish(struct apple_fan_data *data, int fan,
+                                    struct apple_fan_curve *curve);
+// -EINVAL unless the points of 'curve' are in range and ascending
+static int apple_fan_curve_check_points(const struct apple_fan_curve *curve);
+// -EINVAL unless 'curve' is complete and consistent
+static int apple_fan_curve_check(struct apple_fan_data *data,
+                                 const struct apple_fan_curve *curve);
+
+// parse "temp:pwm ..." (ascending temp) into the points of 'curve', -EINVAL
+// without any point
+static int apple_fan_parse_curve(const char *buf, size_t count,
+                                 struct apple_fan_curve *curve);
+
+// hand fan with index 'fan' over to the curve controller
+static int apple_fan_set_curve_mode(struct apple_fan_data *data, int fan);
+
+// closed-loop controller, applies the fan curves every 'curve_interval' ms
+static void apple_fan_controller_work(struct work_struct *work);
+
+// cpu utilization (percent) since the last sample, weighted by the current
+// over the maximum cpufreq frequency where cpufreq is available
+static int apple_fan_load_sample(struct apple_fan_load *load);
+// feed-forward input (percent) of the controller, 0 until the utilization
+// stayed above the threshold for 'lead_ms'
+static int apple_fan_load_level(struct apple_fan_load *load);
+
+// fanX_curve / fanX_curve_hyst => curve configuration
+static ssize_t fan_get_curve(struct device *dev, struct device_attribute *attr,
                              char *buf);
-static ssize_t fan1_set_mode(struct device *dev, struct device_attribute *attr,
+static ssize_t fan_set_curve(struct device *dev, struct device_attribute *attr,
                              const char *buf, size_t count);
-
-// gfx fan api funcs
-static ssize_t fan2_get_mode(struct device *dev, struct device_attribute *attr,
+static ssize_t fan_get_curve_hyst(struct device *dev,
+                                  struct device_attribute *attr, char *buf);
+static ssize_t fan_set_curve_hyst(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count);
+
+// fanX_ff_gain / fan_ff_threshold / fan_ff_lead => feed-forward configuration,
+// fan_ff_load => utilization (percent) seen by the controller
+static ssize_t fan_get_ff_gain(struct device *dev,
+                               struct device_attribute *attr, char *buf);
+static ssize_t fan_set_ff_gain(struct device *dev,
+                               struct device_attribute *attr, const char *buf,
+                               size_t count);
+static ssize_t fan_get_ff_threshold(struct device *dev,
+                                    struct device_attribute *attr, char *buf);
+static ssize_t fan_set_ff_threshold(struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count);
+static ssize_t fan_get_ff_lead(struct device *dev,
+                               struct device_attribute *attr, char *buf);
+static ssize_t fan_set_ff_lead(struct device *dev,
+                               struct device_attribute *attr, const char *buf,
+                               size_t count);
+static ssize_t fan_get_ff_load(struct device *dev,
+                               struct device_attribute *attr, char *buf);
+
+// fanX_slew / fanX_deadband / fan_temp_ema => EC write reduction
+static ssize_t fan_get_slew(struct device *dev, struct device_attribute *attr,
+                            char *buf);
+static ssize_t fan_set_slew(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count);
+static ssize_t fan_get_deadband(struct device *dev,
+                                struct device_attribute *attr, char *buf);
+static ssize_t fan_set_deadband(struct device *dev,
+                                struct device_attribute *attr, const char *buf,
+                                size_t count);
+static ssize_t fan_get_temp_ema(struct device *dev,
+                                struct device_attribute *attr, char *buf);
+static ssize_t fan_set_temp_ema(struct device *dev,
+                                struct device_attribute *attr, const char *buf,
+                                size_t count);
+
+// fanX_curve_table => whole curve incl. ramp and source sensor, see 'struct
+// apple_fan_curve_table', written in one piece
+static ssize_t fan_read_curve_table(struct file *file, struct kobject *kobj,
+                                    struct bin_attribute *attr, char *buf,
+                                    loff_t off, size_t count);
+static ssize_t fan_write_curve_table(struct file *file, struct kobject *kobj,
+                                     struct bin_attribute *attr, char *buf,
+                                     loff_t off, size_t count);
+
+// thermal cooling device ops, states 0 - APPLE_COOLING_STATES map linearly
+// onto the fan state (0 - 255)
+static int apple_fan_cooling_get_max_state(struct thermal_cooling_device *cdev,
+                                           unsigned long *state);
+static int apple_fan_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+                                           unsigned long *state);
+static int apple_fan_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+                                           unsigned long state);
+
+// thermal zone ops of TH1R
+static int apple_fan_tz_get_temp(struct thermal_zone_device *tz, int *temp);
+static int apple_fan_tz_bind(struct thermal_zone_device *tz,
+                             struct thermal_cooling_device *cdev);
+
+// register/unregister cooling devices and the thermal zone
+static int apple_fan_thermal_init(struct apple_fan_data *data);
+static void apple_fan_thermal_exit(struct apple_fan_data *data);
+
+// platform_profile handler, a switch applies max speed, minimum and curve of
+// the preset to all fans within one 'ec_lock' section
+// - only fans already in curve mode move to the new curve right away, fans in
+//   auto or manual mode stay there until the user selects curve mode
+static int apple_fan_profile_get(struct platform_profile_handler *pprof,
+                                 enum platform_profile_option *profile);
+static int apple_fan_profile_set(struct platform_profile_handler *pprof,
+                                 enum platform_profile_option profile);
+// register/unregister the handler, the driver works without it
+static void apple_fan_profile_init(struct apple_fan_data *data);
+static void apple_fan_profile_exit(struct apple_fan_data *data);
+
+// consistent lock-free view of the state and mode of 'fan'
+static void apple_fan_read_state(struct apple_fan_data *data, int fan,
+                                 int *state, enum apple_fan_mode *mode);
+
+// speed (RPM) of 'state' according to the FAN_FIT_* fit
+static int apple_fan_fit_rpm(int state);
+
+// fill 'table' from 'calib', falls back to the fit without points
+static void apple_fan_build_table(const struct apple_fan_calib *calib,
+                                  int *table);
+
+// pick the calibration of this model (by DMI product name) and build tables
+static void apple_fan_calib_init(struct apple_fan_data *data);
+
+// split token "a:b" into two decimal integers, -EINVAL on anything else
+// (trailing characters, overflow) - 'tok' is modified
+static int apple_fan_parse_pair(char *tok, int *a, int *b);
+// parse "pwm:rpm ..." (ascending pwm and rpm) into 'calib'
+static int apple_fan_parse_calib(const char *buf, size_t count,
+                                 struct apple_fan_calib *calib);
+
+// replace the calibration of 'fan' and rebuild its table
+static int apple_fan_set_calib(struct apple_fan_data *data, int fan,
+                               const struct apple_fan_calib *calib);
+
+// 'true' - if the raw readings of a sweep follow the fan state, see
+// SWEEP_MIN_SPAN_RPM and SWEEP_MIN_RISES
+static bool apple_fan_sweep_plausible(const struct apple_fan_calib *calib);
+// calibration sweep: start/abort, the per-step worker and mode restore
+static int apple_fan_sweep_start(struct apple_fan_data *data, int fan);
+static void apple_fan_sweep_abort(struct apple_fan_data *data, int fan);
+static void apple_fan_sweep_work(struct work_struct *work);
+static void apple_fan_sweep_restore(struct apple_fan_sweep *sweep);
+// 'true' - if user writes to 'fan' must be refused (-EBUSY)
+static bool apple_fan_sweeping(struct apple_fan_data *data, int fan);
+// 'true' - if a sweep of any fan is running
+static bool apple_fan_any_sweeping(struct apple_fan_data *data);
+// auto-mode on behalf of the user, switches all fans and is therefore refused
+// (-EBUSY) while any sweep is running, -EIO if the EC fails
+static int apple_fan_user_set_auto(struct apple_fan_data *data);
+// 'true' - if any fan not in 'fans' (mask of fan indices) is in manual/curve
+// mode on behalf of the user
+static bool apple_fan_others_claimed(struct apple_fan_data *data,
+                                     unsigned long fans);
+
+// fanX_calibrate => start ("1") / abort ("0") a sweep, reads the status
+static ssize_t fan_get_sweep(struct device *dev, struct device_attribute *attr,
                              char *buf);
-static ssize_t fan2_set_mode(struct device *dev, struct device_attribute *attr,
+static ssize_t fan_set_sweep(struct device *dev, struct device_attribute *attr,
                              const char *buf, size_t count);
 
-// generic fan func (no sense as long as auto-mode is bound to both or none of
-// the fans...
-// - force 'reset' of max-speed (if reset == true) and change to auto-mode
-static int fan_set_max_speed(unsigned long state, bool reset);
-// acpi-readout
-static int fan_get_max_speed(unsigned long *state);
-
-// set fan(s) to automatic mode
-static int fan_set_auto(void);
-
-// set fan with index 'fan' to 'speed'
-// - includes manual mode activation
-static int fan_set_speed(int fan, int speed);
+// fan_sync => waits until stored pwm values reached the EC, -EIO if any of
+// them failed since the last sync
+static ssize_t fan_set_sync(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count);
 
-// reports current speed of the fan (unit:RPM)
-static int __fan_rpm(int fan);
+// conversions between fan state (0 - 255) and speed (RPM) through 'table'
+// - rpm to state is a binary search, 'table' must be monotonic
+static unsigned int apple_fan_rpm_to_state(const int *table, int rpm);
+static int apple_fan_state_to_rpm(const int *table, int state);
 
-// Writes RPMs of fan0 (CPU fan) to buf => needed for hwmon device
-static ssize_t fan_rpm(struct device *dev, struct device_attribute *attr,
-                       char *buf);
+// fanX_calibration => "pwm:rpm ..." anchor points of the conversion table
+static ssize_t fan_get_calib(struct device *dev, struct device_attribute *attr,
+                             char *buf);
+static ssize_t fan_set_calib(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count);
 
-// Writes RPMs of fan1 (GPU fan) to buf => needed for hwmon device
-static ssize_t fan_rpm_gfx(struct device *dev, struct device_attribute *attr,
-                           char *buf);
-// Writes Label of fan0 (CPU fan) to buf => needed for hwmon device
-static ssize_t fan_label(struct device *dev, struct device_attribute *attr,
-                         char *buf);
+// fan state derived from the cached sensor values (no refresh)
+static unsigned long __fan_cached_state(struct apple_fan_data *data, int fan);
 
-// Writes Label of fan1 (GPU fan) to buf => needed for hwmon device
-static ssize_t fan_label_gfx(struct device *dev, struct device_attribute *attr,
-                             char *buf);
-// Writes Minimal speed of fan0 (CPU fan) to buf => needed for hwmon device
-static ssize_t fan_min(struct device *dev, struct device_attribute *attr,
-                       char *buf);
+// hidden fan api funcs used for both (wrap into them)
+static int __fan_get_cur_state(struct apple_fan_data *data, int fan,
+                               unsigned long *state);
+static int __fan_set_cur_state(struct apple_fan_data *data, int fan,
+                               unsigned long state);
+// switch fan with index 'fan' to manual mode at 'state', caller must hold
+// 'ec_lock'
+static int __fan_apply_state(struct apple_fan_data *data, int fan,
+                             unsigned long state);
+
+// record 'state' as the setpoint of fan with index 'fan' and apply it
+// asynchronously, only the latest setpoint of each fan reaches the EC
+static void apple_fan_queue_speed(struct apple_fan_data *data, int fan,
+                                  unsigned long state);
+static void apple_fan_speed_work(struct work_struct *work);
+// state to write to 'fan' on the way to 'target' under its deadband and slew
+// limit ('period_ms' apart), -1 if there is nothing to write, caller must
+// hold 'ec_lock'
+static int __fan_limit_state(struct apple_fan_data *data, int fan, int target,
+                             unsigned int period_ms);
+// wait for queued setpoints to be applied, returns the first error since the
+// last flush
+static acpi_status apple_fan_flush_speed(struct apple_fan_data *data);
 
-// Writes Minimal speed of fan1 (GPU fan) to buf => needed for hwmon device
-static ssize_t fan_min_gfx(struct device *dev, struct device_attribute *attr,
-                           char *buf);
+// get current mode (auto, manual, perhaps auto mode of module in future)
+static int __fan_get_cur_control_state(struct apple_fan_data *data, int fan,
+                                       int *state);
+// switch between modes (auto, manual, perhaps auto mode of module in future)
+static int __fan_set_cur_control_state(struct apple_fan_data *data, int fan,
+                                       int state);
 
-// sets maximal speed for auto and manual mode => needed for hwmon device
-static ssize_t set_max_speed(struct device *dev, struct device_attribute *attr,
+// parse 'auto' / 'manual' from buf and switch fan with index 'fan'
+static ssize_t _fan_set_mode(struct apple_fan_data *data, int fan,
                              const char *buf, size_t count);
 
-// writes maximal speed for auto and manual mode to buf => needed for hwmon
-// device
-static ssize_t get_max_speed(struct device *dev, struct device_attribute *attr,
+// fanX_mode => non-standard hwmon attribute, channel from attr index
+static ssize_t fan_get_mode(struct device *dev, struct device_attribute *attr,
+                            char *buf);
+static ssize_t fan_set_mode(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count);
+
+// fanX_speed => non-standard hwmon attribute (alias of pwmX)
+static ssize_t fan_get_speed(struct device *dev, struct device_attribute *attr,
                              char *buf);
+static ssize_t fan_set_speed_attr(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count);
+
+// generic fan func (no sense as long as auto-mode is bound to both or none of
+// the fans...
+// - force 'reset' of max-speed (if reset == true) and change to auto-mode
+static int fan_set_max_speed(struct apple_fan_data *data, unsigned long state,
+                             bool reset);
+// acpi-readout
+static int fan_get_max_speed(struct apple_fan_data *data,
+                             unsigned long *state);
 
-// GFX temperature
-static ssize_t temp1_input(struct device *dev, struct device_attribute *attr,
-                           char *buf);
-// GFX label
-static ssize_t temp1_crit(struct device *dev, struct device_attribute *attr,
-                          char *buf);
-// GFX crit
-static ssize_t temp1_label(struct device *dev, struct device_attribute *attr,
-                           char *buf);
+// set fan(s) to automatic mode
+static int fan_set_auto(struct apple_fan_data *data);
 
-// is the hwmon interface visible?
-static umode_t apple_hwmon_sysfs_is_visible(struct kobject *kobj,
-                                            struct attribute *attr, int idx);
+// set fan with index 'fan' to 'speed', caller must hold 'ec_lock'
+// - includes manual mode activation
+static int fan_set_speed(struct apple_fan_data *data, int fan, int speed);
+
+// reports current speed of the fan (unit:RPM), caller must hold 'ec_lock'
+static acpi_status __fan_rpm(struct apple_fan_data *data, int fan, int *rpm);
+
+// find the fans answering a speed readout (during probe), -ENODEV if none
+static int apple_fan_fans_init(struct apple_fan_data *data);
+
+// find the available temperature sensors (during probe)
+static void apple_fan_temp_init(struct apple_fan_data *data);
+
+// readout of sensor 'desc' (millidegree celsius), caller must hold 'ec_lock'
+static acpi_status __temp_read(struct apple_fan_data *data,
+                               const struct apple_fan_temp_desc *desc,
+                               long *value);
+
+// translate between 'enum apple_fan_mode' and pwmX_enable, -EINVAL for
+// unsupported pwmX_enable values
+static long apple_fan_mode_to_pwm_enable(enum apple_fan_mode mode);
+static int apple_fan_pwm_enable_to_mode(long val, enum apple_fan_mode *mode);
+
+// hwmon core callbacks, dispatched by sensor type and channel
+static umode_t apple_hwmon_is_visible(const void *drvdata,
+                                      enum hwmon_sensor_types type, u32 attr,
+                                      int channel);
+static int apple_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+                            u32 attr, int channel, long *val);
+static int apple_hwmon_read_string(struct device *dev,
+                                   enum hwmon_sensor_types type, u32 attr,
+                                   int channel, const char **str);
+static int apple_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+                             u32 attr, int channel, long val);
 
 // initialization of hwmon interface
 static int apple_fan_hwmon_init(struct apple_fan *apple);
@@ -239,8 +1403,10 @@ static int apple_fan_hwmon_init(struct apple_fan *apple);
 // remove "apple_fan" subfolder from /sys/devices/platform
 static void apple_fan_sysfs_exit(struct platform_device *device);
 
-// set up platform device and call hwmon init
+// set up platform device, the hardware is set up by apple_fan_init_work()
 static int apple_fan_probe(struct platform_device *pdev);
+// EC discovery, hwmon init and everything else depending on the hardware
+static void apple_fan_init_work(struct work_struct *work);
 
 // do anything needed to remove platform device
 static int apple_fan_remove(struct platform_device *device);
@@ -251,497 +1417,3562 @@ int __init_or_module apple_fan_register_driver(struct apple_fan_driver *driver);
 // remove the driver
 void apple_fan_unregister_driver(struct apple_fan_driver *driver);
 
-// housekeeping (module) stuff...
-static void __exit fan_exit(void);
-static int __init fan_init(void);
-
 // ----------------------IMPLEMENTATIONS-------------------------- //
 
-static int __fan_get_cur_state(int fan, unsigned long *state) {
-  // RPM*RPM*0,0000095+0,01028*RPM+26,5
-
-  int rpm = __fan_rpm(fan);
+static void apple_fan_resolve_methods(struct apple_fan_data *data) {
+  struct apple_fan_acpi_method *method;
+  acpi_status ret;
+  int i;
 
-  dbg_msg("fan-id: %d | get RPM", fan);
+  for (i = 0; i < APPLE_METHOD_COUNT; i++) {
+    method = &data->methods[i];
 
-  if (apple_data.fan_manual_mode[fan]) {
-    *state = apple_data.fan_states[fan];
-  } else {
-    if (rpm == 0) {
-      *state = 0;
-      return 0;
-    }
+    ret = acpi_get_handle(NULL, method->path, &method->handle);
+    method->present = ACPI_SUCCESS(ret);
 
-    *state = rpm * rpm * 100 / 10526316 + rpm * 1000 / 97276 + 26;
-    // ensure state is within a valid range
-    if (*state > 255) {
-      *state = 0;
-    }
+    dbg_msg("resolve acpi method: %s -> %s", method->path,
+            acpi_format_exception(ret));
   }
-  return 0;
 }
 
-static int __fan_set_cur_state(int fan, unsigned long state) {
-  dbg_msg("fan-id: %d | set state: %d", fan, state);
-  // catch illegal state set
-  if (state > 255) {
-    warn_msg("set pwm", "illegal value provided: %d ", fan, state);
-    return 1;
-  }
-
-  apple_data.fan_states[fan] = state;
-  apple_data.fan_manual_mode[fan] = true;
-  return fan_set_speed(fan, state);
+// integer argument 'i' of 'args' (for tracing), 0 if not passed
+static u64 apple_fan_arg(struct acpi_object_list *args, unsigned int i) {
+  if (!args || i >= args->count)
+    return 0;
+  return args->pointer[i].integer.value;
 }
 
-static int __fan_get_cur_control_state(int fan, int *state) {
-  dbg_msg("fan-id: %d | get control state", fan);
-  *state = apple_data.fan_manual_mode[fan];
-  return 0;
+static acpi_status apple_fan_evaluate(struct apple_fan_data *data,
+                                      enum apple_fan_method method,
+                                      struct acpi_object_list *args,
+                                      unsigned long long *value) {
+  struct apple_fan_acpi_method *m = &data->methods[method];
+  acpi_status ret;
+  u64 start, duration;
+
+  lockdep_assert_held(&data->ec_lock);
+
+  // missing methods were already detected during probe, don't ask acpi again
+  if (!m->present)
+    return AE_NOT_FOUND;
+  if (apple_fan_breaker_open(data, method))
+    return AE_APPLE_BREAKER_OPEN;
+
+  if (trace_apple_fan_acpi_eval_enter_enabled())
+    trace_apple_fan_acpi_eval_enter(m->name, args ? args->count : 0,
+                                    apple_fan_arg(args, 0),
+                                    apple_fan_arg(args, 1));
+
+  start = ktime_get_ns();
+  ret = acpi_evaluate_integer(m->handle, NULL, args, value);
+  duration = ktime_get_ns() - start;
+
+  trace_apple_fan_acpi_eval_exit(m->name, ret, ret == AE_OK ? *value : 0,
+                                 duration);
+  apple_fan_account(data, method, ret, duration);
+  apple_fan_breaker_record(data, method, ret);
+  return ret;
 }
 
-static int __fan_set_cur_control_state(int fan, int state) {
-  dbg_msg("fan-id: %d | set control state: %d", fan, state);
-  if (state == 0) {
-    return fan_set_auto();
-  }
-  return 0;
+static bool apple_fan_breaker_open(struct apple_fan_data *data,
+                                   enum apple_fan_method method) {
+  struct apple_fan_acpi_method *m = &data->methods[method];
+
+  if (m->critical || m->failures < BREAKER_THRESHOLD)
+    return false;
+  // half-open: let one call through once the backoff expired
+  return time_before(jiffies, m->retry_at);
 }
 
-static int fan_set_speed(int fan, int speed) {
-  union acpi_object args[2];
-  unsigned long long value;
+static void apple_fan_breaker_record(struct apple_fan_data *data,
+                                     enum apple_fan_method method,
+                                     acpi_status ret) {
+  struct apple_fan_acpi_method *m = &data->methods[method];
+
+  if (ret == AE_OK) {
+    if (m->failures >= BREAKER_THRESHOLD)
+      info_msg("health", "%s recovered", m->name);
+    m->failures = 0;
+    m->backoff_ms = 0;
+    return;
+  }
 
-  dbg_msg("fan-id: %d | set speed: %d", fan, speed);
+  if (m->critical || ++m->failures < BREAKER_THRESHOLD)
+    return;
 
-  // set speed to 'speed' for given 'fan'-index
-  // -> automatically switch to manual mode!
-  params.count = ARRAY_SIZE(args);
-  params.pointer = args;
-  // Args:
-  // fan index
-  // - add '1' to index as '0' has a special meaning (auto-mode)
-  args[0].type = ACPI_TYPE_INTEGER;
-  args[0].integer.value = fan + 1;
-  // target fan speed
-  // - between 0x00 and MAX (0 - MAX)
-  //   - 'MAX' is usually 0xFF (255)
-  //   - should be getable with fan_get_max_speed()
-  args[1].type = ACPI_TYPE_INTEGER;
-  args[1].integer.value = speed;
-  // acpi call
-  return acpi_evaluate_integer(NULL, "\\_SB.PCI0.LPCB.EC0.SFNV", &params,
-                               &value);
+  if (!m->backoff_ms) {
+    m->backoff_ms = BREAKER_BACKOFF_MIN_MS;
+    m->trips++;
+    warn_msg("health", "%s failed %u times, errcode: %s - backing off",
+             m->name, m->failures, acpi_format_exception(ret));
+  } else {
+    m->backoff_ms =
+        min_t(unsigned int, m->backoff_ms * 2, BREAKER_BACKOFF_MAX_MS);
+  }
+  m->retry_at = jiffies + msecs_to_jiffies(m->backoff_ms);
 }
 
-static int __fan_rpm(int fan) {
-  struct acpi_object_list params;
-  union acpi_object args[1];
-  unsigned long long value;
-  acpi_status ret;
+static void apple_fan_breaker_reset(struct apple_fan_data *data,
+                                    enum apple_fan_method method) {
+  struct apple_fan_acpi_method *m = &data->methods[method];
 
-  dbg_msg("fan-id: %d | get RPM", fan);
+  m->failures = 0;
+  m->backoff_ms = 0;
+}
 
-  // fan does not report during manual speed setting - so fake it!
-  if (apple_data.fan_manual_mode[fan]) {
-    value = apple_data.fan_states[fan] * apple_data.fan_states[fan] * 1000 -
-            16054 + apple_data.fan_states[fan] * 32648 / 1000 - 365;
+static int apple_fan_errno(acpi_status ret) {
+  if (ret == AE_OK)
+    return 0;
+  if (ret == AE_NOT_FOUND || ret == AE_APPLE_BREAKER_OPEN)
+    return -ENODATA;
+  return -EIO;
+}
 
-    dbg_msg("|--> get RPM for manual mode, calculated: %d", value);
+static void apple_fan_account(struct apple_fan_data *data,
+                              enum apple_fan_method method, acpi_status ret,
+                              u64 duration) {
+  unsigned int bucket = fls64(div_u64(duration, NSEC_PER_USEC));
 
-    if (value > 10000)
-      return 0;
-  } else {
-    dbg_msg("|--> get RPM using acpi");
+  bucket = min_t(unsigned int, bucket, APPLE_FAN_HIST_BUCKETS - 1);
 
-    // getting current fan 'speed' as 'state',
-    params.count = ARRAY_SIZE(args);
-    params.pointer = args;
-    // Args:
-    // - get speed from the fan with index 'fan'
-    args[0].type = ACPI_TYPE_INTEGER;
-    args[0].integer.value = fan;
+  this_cpu_inc(data->stats->methods[method].calls);
+  if (ret != AE_OK)
+    this_cpu_inc(data->stats->methods[method].errors);
+  this_cpu_add(data->stats->methods[method].time_ns, duration);
+  this_cpu_inc(data->stats->methods[method].hist[bucket]);
+}
 
-    char path = PATH;
+static int apple_fan_stats_show(struct seq_file *s, void *unused) {
+  struct apple_fan_data *data = s->private;
+  struct apple_fan_method_stats sum, *cur;
+  int cpu, i, b;
+
+  for (i = 0; i < APPLE_METHOD_COUNT; i++) {
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+      cur = &per_cpu_ptr(data->stats, cpu)->methods[i];
+
+      sum.calls += cur->calls;
+      sum.errors += cur->errors;
+      sum.time_ns += cur->time_ns;
+      for (b = 0; b < APPLE_FAN_HIST_BUCKETS; b++)
+        sum.hist[b] += cur->hist[b];
+    }
 
-    dbg_msg("|--> evaluate acpi request: %s", path);
-    // acpi call
-    ret = acpi_evaluate_integer(NULL, path, &params, &value);
-    dbg_msg("|--> acpi request returned: %s", acpi_format_exception(ret));
+    seq_printf(s, "%s: present=%d calls=%llu errors=%llu avg_us=%llu\n",
+               data->methods[i].name, data->methods[i].present, sum.calls,
+               sum.errors,
+               sum.calls ? div64_u64(sum.time_ns, sum.calls * NSEC_PER_USEC)
+                         : 0);
 
-    if (ret != AE_OK)
-      return -1;
+    // bucket 'b' counts latencies below 2^b us
+    for (b = 0; b < APPLE_FAN_HIST_BUCKETS; b++) {
+      if (sum.hist[b])
+        seq_printf(s, "  < %llu us: %llu\n", 1ULL << b, sum.hist[b]);
+    }
   }
-  return (int)value;
+  return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(apple_fan_stats);
+
+static int apple_fan_health_show(struct seq_file *s, void *unused) {
+  struct apple_fan_data *data = s->private;
+  struct apple_fan_acpi_method *m;
+  const char *state;
+  long retry_ms;
+  int i;
+
+  mutex_lock(&data->ec_lock);
+  for (i = 0; i < APPLE_METHOD_COUNT; i++) {
+    m = &data->methods[i];
+
+    retry_ms = 0;
+    if (!m->present) {
+      state = "disabled";
+    } else if (m->failures < BREAKER_THRESHOLD || m->critical) {
+      state = "closed";
+    } else if (apple_fan_breaker_open(data, i)) {
+      state = "open";
+      retry_ms = jiffies_to_msecs(m->retry_at - jiffies);
+    } else {
+      state = "half-open";
+    }
 
-static ssize_t fan_rpm(struct device *dev, struct device_attribute *attr,
-                       char *buf) {
-  return sprintf(buf, "%d\n", __fan_rpm(0));
+    seq_printf(s,
+               "%s: state=%s failures=%u trips=%llu backoff_ms=%u "
+               "retry_in_ms=%ld\n",
+               m->name, state, m->failures, m->trips, m->backoff_ms, retry_ms);
+  }
+  mutex_unlock(&data->ec_lock);
+  return 0;
 }
-static ssize_t fan_rpm_gfx(struct device *dev, struct device_attribute *attr,
-                           char *buf) {
-  return sprintf(buf, "%d\n", __fan_rpm(1));
+DEFINE_SHOW_ATTRIBUTE(apple_fan_health);
+
+static int apple_fan_writes_show(struct seq_file *s, void *unused) {
+  struct apple_fan_data *data = s->private;
+  struct apple_fan_writes *w;
+  int fan;
+
+  mutex_lock(&data->ec_lock);
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    w = &data->writes[fan];
+    seq_printf(s,
+               "fan%d: applied=%llu unchanged=%llu deadband=%llu "
+               "slewed=%llu\n",
+               fan + 1, w->applied, w->unchanged, w->deadband, w->slewed);
+  }
+  mutex_unlock(&data->ec_lock);
+  return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(apple_fan_writes);
+
+static void apple_fan_fill_snapshot(struct apple_fan_data *data,
+                                    struct apple_fan_snapshot *snap) {
+  enum apple_fan_mode mode;
+  unsigned long max_speed;
+  int fan, state, i;
+
+  memset(snap, 0, sizeof(*snap));
+  snap->version = APPLE_SNAPSHOT_VERSION;
+  snap->size = sizeof(*snap);
+
+  // all values below are taken under the same lock as a sensor refresh
+  mutex_lock(&data->update_lock);
+  // without the sampler the cache is only as fresh as the last read
+  if (!data->update_interval || apple_fan_is_stale(data, max_age)) {
+    __apple_fan_update(data);
+    __apple_fan_ring_push_on_demand(data, data->last_updated_ns);
+  }
 
-static ssize_t fan1_get_mode(struct device *dev, struct device_attribute *attr,
-                             char *buf) {
-  /* = false;
-  unsigned long state = 0;
-  __fan_get_cur_state(0, &state);*/
-  if (apple_data.fan_manual_mode[0])
-    return sprintf(buf, "%s\n", fan_mode_manual_string);
-  else
-    return sprintf(buf, "%s\n", fan_mode_auto_string);
-}
-static ssize_t fan2_get_mode(struct device *dev, struct device_attribute *attr,
-                             char *buf) {
-  if (apple_data.fan_manual_mode[1])
-    return sprintf(buf, "%s\n", fan_mode_manual_string);
-  else
-    return sprintf(buf, "%s\n", fan_mode_auto_string);
-}
+  snap->timestamp_ns = data->last_updated_ns;
+  fan_get_max_speed(data, &max_speed);
+  snap->max_fan_speed = max_speed;
+
+  snap->nr_fans = data->nr_fans;
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    apple_fan_read_state(data, fan, &state, &mode);
+    snap->fans[fan].rpm = data->fan_rpm[fan];
+    snap->fans[fan].pwm = __fan_cached_state(data, fan);
+    snap->fans[fan].mode = mode;
+    snap->fans[fan].min = data->fan_minimum[fan];
+  }
 
-static ssize_t fan1_set_mode(struct device *dev, struct device_attribute *attr,
-                             const char *buf, size_t count) {
-  return _fan_set_mode(0, buf, count);
-}
+  snap->nr_temps = data->nr_temps;
+  for (i = 0; i < data->nr_temps; i++) {
+    snap->temps[i].temp = data->temp[i];
+    snap->temps[i].crit = data->temp_desc[i]->crit * 1000;
+    snap->temps[i].status = apple_fan_errno(data->temp_status[i]);
+  }
+  mutex_unlock(&data->update_lock);
 
-static ssize_t fan2_set_mode(struct device *dev, struct device_attribute *attr,
-                             const char *buf, size_t count) {
-  return _fan_set_mode(1, buf, count);
+  apple_fan_notify(data);
 }
 
-static ssize_t _fan_set_mode(int fan, const char *buf, size_t count) {
-  int state;
-  kstrtouint(buf, 10, &state);
-
-  if (strncmp(buf, fan_mode_auto_string, strlen(fan_mode_auto_string)) == 0 ||
-      strncmp(buf, "0", 1) == 0) {
-    fan_set_auto();
-  } else if (strncmp(buf, fan_mode_manual_string,
-                     strlen(fan_mode_manual_string)) == 0)
-    __fan_set_cur_state(0, (255 - apple_data.fan_minimum) >> 1);
-  else
-    err_msg("set mode",
-            "fan id: %d | setting mode to '%s', use 'auto' or 'manual'",
-            fan + 1, buf);
+static int apple_fan_snapshot_open(struct inode *inode, struct file *file) {
+  struct apple_fan_snapshot *snap;
 
-  return count;
+  // taken once per open, so partial reads still see a coherent record
+  snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+  if (!snap)
+    return -ENOMEM;
+
+  apple_fan_fill_snapshot(inode->i_private, snap);
+  file->private_data = snap;
+  return 0;
 }
 
-static ssize_t fan_get_cur_state(struct device *dev,
-                                 struct device_attribute *attr, char *buf) {
-  unsigned long state = 0;
-  __fan_get_cur_state(0, &state);
-  return sprintf(buf, "%lu\n", state);
+static ssize_t apple_fan_snapshot_read(struct file *file, char __user *buf,
+                                       size_t count, loff_t *ppos) {
+  return simple_read_from_buffer(buf, count, ppos, file->private_data,
+                                 sizeof(struct apple_fan_snapshot));
 }
 
-static ssize_t fan_get_cur_state_gfx(struct device *dev,
-                                     struct device_attribute *attr, char *buf) {
-  unsigned long state = 0;
-  __fan_get_cur_state(1, &state);
-  return sprintf(buf, "%lu\n", state);
+static int apple_fan_snapshot_release(struct inode *inode, struct file *file) {
+  kfree(file->private_data);
+  return 0;
 }
 
-static ssize_t fan_set_cur_state_gfx(struct device *dev,
-                                     struct device_attribute *attr,
-                                     const char *buf, size_t count) {
-  int state;
-  kstrtouint(buf, 10, &state);
-  __fan_set_cur_state(1, state);
-  return count;
+static const struct file_operations apple_fan_snapshot_fops = {
+    .owner = THIS_MODULE,
+    .open = apple_fan_snapshot_open,
+    .read = apple_fan_snapshot_read,
+    .llseek = default_llseek,
+    .release = apple_fan_snapshot_release,
+};
+
+static void apple_fan_debugfs_init(struct apple_fan_data *data) {
+  // debugfs is optional, errors are ignored on purpose
+  data->debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+  debugfs_create_file("stats", S_IRUSR, data->debugfs, data,
+                      &apple_fan_stats_fops);
+  debugfs_create_file("health", S_IRUSR, data->debugfs, data,
+                      &apple_fan_health_fops);
+  debugfs_create_file("writes", S_IRUSR, data->debugfs, data,
+                      &apple_fan_writes_fops);
+  debugfs_create_file("snapshot", S_IRUSR, data->debugfs, data,
+                      &apple_fan_snapshot_fops);
 }
 
-static ssize_t fan_set_cur_state(struct device *dev,
-                                 struct device_attribute *attr, const char *buf,
-                                 size_t count) {
-  int state;
-  kstrtouint(buf, 10, &state);
-  __fan_set_cur_state(0, state);
-  return count;
+// caller must hold 'update_lock'
+static void __apple_fan_update(struct apple_fan_data *data) {
+  unsigned long gen;
+  u64 now;
+  int fan, i;
+
+  // all fans and sensors in one go, the EC is only locked once per refresh
+  mutex_lock(&data->ec_lock);
+  // changes after the unlock below leave this refresh stale right away
+  gen = data->ec_gen;
+  now = ktime_get_ns();
+  for (fan = 0; fan < data->nr_fans; fan++)
+    __apple_fan_update_fan(data, fan);
+  for (i = 0; i < data->nr_temps; i++)
+    __apple_fan_update_temp(data, i, now);
+  mutex_unlock(&data->ec_lock);
+
+  data->last_updated = jiffies;
+  data->last_updated_ns = now;
+  data->cached_gen = gen;
+  data->valid = true;
+  WRITE_ONCE(data->update_gen, data->update_gen + 1);
+
+  __apple_fan_check_alarms(data);
 }
 
-static ssize_t fan_get_cur_control_state(struct device *dev,
-                                         struct device_attribute *attr,
-                                         char *buf) {
-  int state = 0;
-  __fan_get_cur_control_state(0, &state);
-  return sprintf(buf, "%d\n", state);
+static void __apple_fan_update_fan(struct apple_fan_data *data, int fan) {
+  data->fan_rpm_status[fan] = __fan_rpm(data, fan, &data->fan_rpm[fan]);
+  WRITE_ONCE(data->fan_rpm_gen[fan], data->fan_rpm_gen[fan] + 1);
 }
 
-static ssize_t fan_get_cur_control_state_gfx(struct device *dev,
-                                             struct device_attribute *attr,
-                                             char *buf) {
-  int state = 0;
-  __fan_get_cur_control_state(1, &state);
-  return sprintf(buf, "%d\n", state);
+static void __apple_fan_update_temp(struct apple_fan_data *data, int i,
+                                    u64 now) {
+  bool seeded = data->temp_gen[i] && data->temp_status[i] == AE_OK;
+  unsigned int weight;
+
+  data->temp_status[i] = __temp_read(data, data->temp_desc[i], &data->temp[i]);
+  WRITE_ONCE(data->temp_gen[i], data->temp_gen[i] + 1);
+  if (data->temp_status[i] != AE_OK)
+    return;
+
+  // restart from the reading after a gap
+  if (!seeded) {
+    data->temp_filtered[i] = data->temp[i];
+  } else {
+    // the filter follows time, not the number of refreshes
+    weight = apple_fan_ema_weight(READ_ONCE(data->temp_ema),
+                                  now - data->temp_updated_ns[i]);
+    data->temp_filtered[i] +=
+        (data->temp[i] - data->temp_filtered[i]) * (long)weight / 1000;
+  }
+  data->temp_updated_ns[i] = now;
 }
 
-static ssize_t fan_set_cur_control_state_gfx(struct device *dev,
-                                             struct device_attribute *attr,
-                                             const char *buf, size_t count) {
-  int state;
-  kstrtouint(buf, 10, &state);
-  __fan_set_cur_control_state(1, state);
-  return count;
+static unsigned int apple_fan_ema_weight(unsigned int ema, u64 elapsed_ns) {
+  const u64 period = TEMP_EMA_PERIOD_MS * NSEC_PER_MSEC;
+  unsigned int keep = 1000;
+  u64 periods, rest;
+
+  if (ema >= 100)
+    return 1000;
+
+  // whole periods compound, 'keep' reaches 0 long before the bound
+  periods = min_t(u64, div64_u64_rem(elapsed_ns, period, &rest), 1000);
+  for (; periods && keep; periods--)
+    keep = keep * (100 - ema) / 100;
+  // the rest of a period counts linearly
+  keep -= div64_u64((u64)keep * ema * rest, period * 100);
+  return 1000 - keep;
 }
 
-static ssize_t fan_set_cur_control_state(struct device *dev,
-                                         struct device_attribute *attr,
-                                         const char *buf, size_t count) {
-  int state;
-  kstrtouint(buf, 10, &state);
-  __fan_set_cur_control_state(0, state);
-  return count;
+// record an alarm state change as pending 'event'
+static void apple_fan_set_alarm(struct apple_fan_data *data, bool *alarm,
+                                bool state, enum apple_fan_event event) {
+  if (*alarm == state)
+    return;
+
+  *alarm = state;
+  set_bit(event, &data->events);
 }
 
-// TODO: Reading the correct max fan speed does not work!
-static int fan_get_max_speed(unsigned long *state) {
+static void __apple_fan_check_alarms(struct apple_fan_data *data) {
+  int fan;
 
-  dbg_msg("fan-id: (both) | get max speed");
-  *state = apple_data.max_fan_speed_setting;
-  return 0;
+  __apple_fan_check_temp_alarms(data);
+  for (fan = 0; fan < data->nr_fans; fan++)
+    __apple_fan_check_fan_alarm(data, fan);
 }
 
-static int fan_set_max_speed(unsigned long state, bool reset) {
-  union acpi_object args[1];
-  unsigned long long value;
-  acpi_status ret;
-  int arg_qmod = 1;
+static void __apple_fan_check_temp_alarms(struct apple_fan_data *data) {
+  long temp = data->temp[0];
+  bool valid = data->temp_status[0] == AE_OK;
 
-  dbg_msg("fan-id: (both) | set max speed: %d, force reset: %d", state,
-          (unsigned int)reset);
+  apple_fan_set_alarm(data, &data->temp1_max_alarm,
+                      valid && temp >= data->temp1_max,
+                      APPLE_EVENT_TEMP1_MAX_ALARM);
+  apple_fan_set_alarm(data, &data->temp1_crit_alarm,
+                      valid && temp >= TEMP1_CRIT * 1000,
+                      APPLE_EVENT_TEMP1_CRIT_ALARM);
+}
 
-  // if reset is 'true' ignore anything else and reset to
-  // -> auto-mode with max-speed
-  // -> use "SB.ARKD.QMOD" _without_ "SB.QFAN",
-  //    which seems not writeable as expected
-  if (reset) {
-    state = 255;
-    arg_qmod = 2;
-    // Activate the set maximum speed setting
-    // Args:
-    // 0 - just returns
-    // 1 - sets quiet mode to QFAN value
-    // 2 - sets quiet mode to 0xFF (that's the default value)
-    params.count = ARRAY_SIZE(args);
-    params.pointer = args;
-    // pass arg
-    args[0].type = ACPI_TYPE_INTEGER;
-    args[0].integer.value = arg_qmod;
-
-    // acpi call
-    ret = acpi_evaluate_integer(NULL, "\\_SB.ATKD.QMOD", &params, &value);
-    if (ret != AE_OK) {
-      err_msg("set_max_speed",
-              "set max fan speed(s) failed (force reset)! errcode: %s",
-              acpi_format_exception(ret));
-      return ret;
-    }
+static void __apple_fan_check_fan_alarm(struct apple_fan_data *data, int fan) {
+  enum apple_fan_mode mode;
+  bool stalled;
+  int state;
 
-    // if reset was not forced, set max fan speed to 'state'
-  } else {
-    // is applied automatically on any available fan
-    // - docs say it should affect manual _AND_ automatic mode
-    // Args:
-    // - from 0x00 to 0xFF (0 - 255)
-    params.count = ARRAY_SIZE(args);
-    params.pointer = args;
-    // pass arg
-    args[0].type = ACPI_TYPE_INTEGER;
-    args[0].integer.value = state;
-
-    // acpi call
-    ret = acpi_evaluate_integer(NULL, "\\_SB.PCI0.LPCB.EC0.ST98", &params,
-                                &value);
-    if (ret != AE_OK) {
-      err_msg("set_max_speed",
-              "set max fan speed(s) failed (no reset) errcode: %s",
-              acpi_format_exception(ret));
+  // only auto-mode reports a measured speed, where the EC always keeps the
+  // fans spinning - manual/curve mode rpm is derived from the set state
+  apple_fan_read_state(data, fan, &state, &mode);
+  stalled = mode == APPLE_FAN_MODE_AUTO && data->fan_rpm[fan] == 0;
+  apple_fan_set_alarm(data, &data->fan_alarm[fan], stalled,
+                      APPLE_EVENT_FAN1_ALARM + fan);
+}
 
-      return ret;
+static void apple_fan_notify(struct apple_fan_data *data) {
+  struct device *hwmon;
+  unsigned long events;
+  char name[16];
+  int fan;
+
+  if (!READ_ONCE(data->events))
+    return;
+
+  // 'update_lock' keeps the hwmon device from going away (see remove)
+  mutex_lock(&data->update_lock);
+  events = xchg(&data->events, 0);
+  hwmon = data->apple_fan_obj->hwmon_dev;
+  if (IS_ERR_OR_NULL(hwmon))
+    goto out;
+
+  if (test_bit(APPLE_EVENT_TEMP1_MAX_ALARM, &events))
+    hwmon_notify_event(hwmon, hwmon_temp, hwmon_temp_max_alarm, 0);
+  if (test_bit(APPLE_EVENT_TEMP1_CRIT_ALARM, &events))
+    hwmon_notify_event(hwmon, hwmon_temp, hwmon_temp_crit_alarm, 0);
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (test_bit(APPLE_EVENT_FAN1_ALARM + fan, &events))
+      hwmon_notify_event(hwmon, hwmon_fan, hwmon_fan_alarm, fan);
+    if (test_bit(APPLE_EVENT_FAN1_MODE + fan, &events)) {
+      hwmon_notify_event(hwmon, hwmon_pwm, hwmon_pwm_enable, fan);
+      // non-standard alias of pwmX_enable
+      snprintf(name, sizeof(name), "fan%d_mode", fan + 1);
+      sysfs_notify(&hwmon->kobj, NULL, name);
     }
   }
+out:
+  mutex_unlock(&data->update_lock);
+}
 
-  // keep set max fan speed for the get_max
-  apple_data.max_fan_speed_setting = state;
+static void apple_fan_switch_mode(struct apple_fan_data *data, int fan,
+                                  enum apple_fan_mode mode) {
+  if (data->fan_mode[fan] == mode)
+    return;
+
+  trace_apple_fan_set_mode(fan, mode);
+  data->fan_mode[fan] = mode;
+  // a slew of the previous mode must not exempt the next move from the
+  // deadband
+  data->fan_target[fan] = -1;
+  set_bit(APPLE_EVENT_FAN1_MODE + fan, &data->events);
+}
 
-  return ret;
+// 'true' - if the cache is invalid or older than 'age' ms (0 = never too old)
+static bool apple_fan_is_stale(struct apple_fan_data *data, unsigned int age) {
+  unsigned long expires = data->last_updated + msecs_to_jiffies(age);
+
+  return !data->valid || data->cached_gen != READ_ONCE(data->ec_gen) ||
+         (age && time_after(jiffies, expires));
 }
 
-static int fan_set_auto() {
-  union acpi_object args[2];
-  unsigned long long value;
-  acpi_status ret;
+static void __apple_fan_invalidate(struct apple_fan_data *data) {
+  lockdep_assert_held(&data->ec_lock);
+  WRITE_ONCE(data->ec_gen, data->ec_gen + 1);
+}
 
-  dbg_msg("fan-id: (both) | set to automatic mode");
+static void apple_fan_update_fan(struct apple_fan_data *data, int fan) {
+  unsigned long gen = READ_ONCE(data->fan_rpm_gen[fan]);
 
-  // setting (both) to auto-mode simultanously
-  apple_data.fan_manual_mode[0] = false;
-  apple_data.fan_states[0] = -1;
-  if (apple_data.has_gfx_fan) {
-    apple_data.fan_states[1] = -1;
-    apple_data.fan_manual_mode[1] = false;
+  mutex_lock(&data->update_lock);
+  if (data->fan_rpm_gen[fan] == gen) {
+    mutex_lock(&data->ec_lock);
+    __apple_fan_update_fan(data, fan);
+    mutex_unlock(&data->ec_lock);
+    __apple_fan_check_fan_alarm(data, fan);
+    __apple_fan_ring_push_on_demand(data, ktime_get_ns());
   }
+  mutex_unlock(&data->update_lock);
 
-  // acpi call to call auto-mode for all fans!
+  apple_fan_notify(data);
+}
+
+static void apple_fan_update_temp(struct apple_fan_data *data, int i) {
+  unsigned long gen = READ_ONCE(data->temp_gen[i]);
+  u64 now;
+
+  mutex_lock(&data->update_lock);
+  if (data->temp_gen[i] == gen) {
+    now = ktime_get_ns();
+    mutex_lock(&data->ec_lock);
+    __apple_fan_update_temp(data, i, now);
+    mutex_unlock(&data->ec_lock);
+    // only temp1 carries alarms and is part of the ring records
+    if (!i) {
+      __apple_fan_check_temp_alarms(data);
+      __apple_fan_ring_push_on_demand(data, now);
+    }
+  }
+  mutex_unlock(&data->update_lock);
+
+  apple_fan_notify(data);
+}
+
+// refresh the cache if it is invalid or older than 'age' ms
+static void apple_fan_update_if_older(struct apple_fan_data *data,
+                                      unsigned int age) {
+  unsigned long gen = READ_ONCE(data->update_gen);
+
+  if (!apple_fan_is_stale(data, age))
+    return;
+
+  mutex_lock(&data->update_lock);
+  // another reader may have refreshed while we were waiting
+  if (data->update_gen == gen && apple_fan_is_stale(data, age)) {
+    __apple_fan_update(data);
+    __apple_fan_ring_push_on_demand(data, data->last_updated_ns);
+  }
+  mutex_unlock(&data->update_lock);
+
+  apple_fan_notify(data);
+}
+
+static void apple_fan_update_fan_if_stale(struct apple_fan_data *data,
+                                          int fan) {
+  // without the sampler every read refreshes what it returns, a read costs
+  // one EC round-trip and concurrent readers of the same fan share it
+  if (!READ_ONCE(data->update_interval) && !max_age) {
+    apple_fan_update_fan(data, fan);
+    return;
+  }
+  apple_fan_update_if_older(data, max_age);
+}
+
+static void apple_fan_update_temp_if_stale(struct apple_fan_data *data,
+                                           int i) {
+  // see apple_fan_update_fan_if_stale()
+  if (!READ_ONCE(data->update_interval) && !max_age) {
+    apple_fan_update_temp(data, i);
+    return;
+  }
+  apple_fan_update_if_older(data, max_age);
+}
+
+static void apple_fan_sampler_work(struct work_struct *work) {
+  struct apple_fan_data *data =
+      container_of(to_delayed_work(work), struct apple_fan_data, sampler);
+  unsigned long interval;
+
+  mutex_lock(&data->update_lock);
+  __apple_fan_update(data);
+  __apple_fan_ring_push(data, data->last_updated_ns);
+  mutex_unlock(&data->update_lock);
+
+  apple_fan_notify(data);
+
+  interval = READ_ONCE(data->update_interval);
+  if (interval)
+    schedule_delayed_work(&data->sampler, msecs_to_jiffies(interval));
+}
+
+// per-open state of /dev/apple_fan
+struct apple_fan_ring_reader {
+  struct apple_fan_ring *ring;
+  // 'head' acknowledged by the last read(), only advanced by the consumer
+  u64 tail;
+};
+
+static const struct file_operations apple_fan_ring_fops = {
+    .owner = THIS_MODULE,
+    .open = apple_fan_ring_open,
+    .release = apple_fan_ring_close,
+    .mmap = apple_fan_ring_mmap,
+    .read = apple_fan_ring_read,
+    .poll = apple_fan_ring_poll,
+    .llseek = noop_llseek,
+};
+
+static int apple_fan_ring_init(struct apple_fan_data *data) {
+  struct apple_fan_ring *ring;
+  unsigned int depth;
+  int err;
+
+  if (!ring_depth)
+    return 0;
+
+  // power of two, the index is a mask of 'head'
+  depth = roundup_pow_of_two(min_t(unsigned int, ring_depth,
+                                   APPLE_RING_DEPTH_MAX));
+  if (!depth)
+    return -EINVAL;
+
+  ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+  if (!ring)
+    return -ENOMEM;
+  ring->size = PAGE_SIZE + PAGE_ALIGN(depth * sizeof(struct apple_fan_sample));
+  ring->buf = vmalloc_user(ring->size);
+  if (!ring->buf) {
+    kfree(ring);
+    return -ENOMEM;
+  }
+
+  ring->hdr = ring->buf;
+  ring->records = ring->buf + PAGE_SIZE;
+  ring->hdr->version = APPLE_RING_VERSION;
+  ring->hdr->record_size = sizeof(struct apple_fan_sample);
+  ring->hdr->nr_records = depth;
+  ring->hdr->nr_fans = data->nr_fans;
+  init_waitqueue_head(&ring->wait);
+  kref_init(&ring->kref);
+
+  data->ring_dev.minor = MISC_DYNAMIC_MINOR;
+  data->ring_dev.name = DRIVER_NAME;
+  data->ring_dev.fops = &apple_fan_ring_fops;
+  data->ring_dev.parent = &data->apple_fan_obj->platform_device->dev;
+  data->ring_dev.mode = S_IRUSR;
+
+  err = misc_register(&data->ring_dev);
+  if (err) {
+    kref_put(&ring->kref, apple_fan_ring_release);
+    return err;
+  }
+
+  // published last, the sampler may already be running
+  mutex_lock(&data->update_lock);
+  data->ring = ring;
+  mutex_unlock(&data->update_lock);
+  return 0;
+}
+
+static void apple_fan_ring_exit(struct apple_fan_data *data) {
+  struct apple_fan_ring *ring;
+
+  mutex_lock(&data->update_lock);
+  ring = data->ring;
+  data->ring = NULL;
+  mutex_unlock(&data->update_lock);
+
+  if (!ring)
+    return;
+
+  misc_deregister(&data->ring_dev);
+  // open files keep their reference, mapped pages stay until unmapped
+  kref_put(&ring->kref, apple_fan_ring_release);
+}
+
+static void apple_fan_ring_release(struct kref *kref) {
+  struct apple_fan_ring *ring = container_of(kref, struct apple_fan_ring, kref);
+
+  vfree(ring->buf);
+  kfree(ring);
+}
+
+static void __apple_fan_ring_push(struct apple_fan_data *data,
+                                  u64 timestamp_ns) {
+  struct apple_fan_ring *ring = data->ring;
+  struct apple_fan_sample *rec;
+  enum apple_fan_mode mode;
+  int fan, state;
+  u64 head;
+
+  if (!ring)
+    return;
+
+  head = ring->hdr->head;
+  rec = &ring->records[head & (ring->hdr->nr_records - 1)];
+
+  rec->timestamp_ns = timestamp_ns;
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    apple_fan_read_state(data, fan, &state, &mode);
+    rec->rpm[fan] = data->fan_rpm[fan];
+    rec->pwm[fan] = __fan_cached_state(data, fan);
+    rec->mode[fan] = mode;
+  }
+  rec->temp = data->temp[0];
+  rec->flags = data->temp_status[0] == AE_OK ? APPLE_SAMPLE_TEMP_VALID : 0;
+
+  // the record must be visible before the new head
+  smp_store_release(&ring->hdr->head, head + 1);
+  wake_up_interruptible(&ring->wait);
+}
+
+static void __apple_fan_ring_push_on_demand(struct apple_fan_data *data,
+                                            u64 timestamp_ns) {
+  // with the sampler running its records alone keep the ring evenly spaced
+  if (!READ_ONCE(data->update_interval))
+    __apple_fan_ring_push(data, timestamp_ns);
+}
+
+static int apple_fan_ring_open(struct inode *inode, struct file *file) {
+  struct apple_fan_data *data =
+      container_of(file->private_data, struct apple_fan_data, ring_dev);
+  struct apple_fan_ring_reader *reader;
+
+  reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+  if (!reader)
+    return -ENOMEM;
+
+  mutex_lock(&data->update_lock);
+  reader->ring = data->ring;
+  if (reader->ring)
+    kref_get(&reader->ring->kref);
+  mutex_unlock(&data->update_lock);
+
+  if (!reader->ring) {
+    kfree(reader);
+    return -ENODEV;
+  }
+
+  reader->tail = smp_load_acquire(&reader->ring->hdr->head);
+  file->private_data = reader;
+  return 0;
+}
+
+static int apple_fan_ring_close(struct inode *inode, struct file *file) {
+  struct apple_fan_ring_reader *reader = file->private_data;
+
+  kref_put(&reader->ring->kref, apple_fan_ring_release);
+  kfree(reader);
+  return 0;
+}
+
+static int apple_fan_ring_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct apple_fan_ring_reader *reader = file->private_data;
+
+  // consumers only read, the producer never looks at the mapping
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  vm_flags_clear(vma, VM_MAYWRITE);
+
+  return remap_vmalloc_range(vma, reader->ring->buf, vma->vm_pgoff);
+}
+
+static ssize_t apple_fan_ring_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos) {
+  struct apple_fan_ring_reader *reader = file->private_data;
+  struct apple_fan_ring *ring = reader->ring;
+  u64 head;
+  int err;
+
+  if (count < sizeof(head))
+    return -EINVAL;
+
+  for (;;) {
+    head = smp_load_acquire(&ring->hdr->head);
+    if (head != READ_ONCE(reader->tail))
+      break;
+    if (file->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+    err = wait_event_interruptible(ring->wait,
+                                   smp_load_acquire(&ring->hdr->head) !=
+                                       READ_ONCE(reader->tail));
+    if (err)
+      return err;
+  }
+
+  if (copy_to_user(buf, &head, sizeof(head)))
+    return -EFAULT;
+
+  WRITE_ONCE(reader->tail, head);
+  return sizeof(head);
+}
+
+static __poll_t apple_fan_ring_poll(struct file *file, poll_table *wait) {
+  struct apple_fan_ring_reader *reader = file->private_data;
+  struct apple_fan_ring *ring = reader->ring;
+  u64 head;
+
+  poll_wait(file, &ring->wait, wait);
+
+  // readable until the consumer acknowledges the new records with read()
+  head = smp_load_acquire(&ring->hdr->head);
+  if (head == READ_ONCE(reader->tail))
+    return 0;
+
+  return EPOLLIN | EPOLLRDNORM;
+}
+
+static int apple_fan_curve_eval(const struct apple_fan_curve *curve, int temp) {
+  const struct apple_fan_curve_point *lo, *hi;
+  int i;
+
+  if (temp <= curve->points[0].temp)
+    return curve->points[0].pwm;
+
+  for (i = 1; i < curve->npoints; i++) {
+    lo = &curve->points[i - 1];
+    hi = &curve->points[i];
+
+    if (temp < hi->temp)
+      return lo->pwm + div_s64((s64)(hi->pwm - lo->pwm) * ((s64)temp - lo->temp),
+                               hi->temp - lo->temp);
+  }
+  return curve->points[curve->npoints - 1].pwm;
+}
+
+static int apple_fan_curve_target(const struct apple_fan_curve *curve,
+                                  int temp, int cur) {
+  int target;
+
+  // the points lie within these bounds, so the result stays the same
+  temp = clamp(temp, CURVE_TEMP_MIN, CURVE_TEMP_MAX);
+  target = apple_fan_curve_eval(curve, temp);
+
+  if (cur < 0 || target >= cur)
+    return target;
+
+  // slowing down: evaluate as if it was 'hysteresis' degrees warmer
+  return min(apple_fan_curve_eval(curve, temp + curve->hysteresis), cur);
+}
+
+static int apple_fan_curves_init(struct apple_fan_data *data) {
+  struct apple_fan_curve *curve;
+  int fan;
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    curve = kmemdup(&apple_fan_profiles[PLATFORM_PROFILE_BALANCED].curve,
+                    sizeof(*curve), GFP_KERNEL);
+    if (!curve)
+      return -ENOMEM;
+    RCU_INIT_POINTER(data->fan_curve[fan], curve);
+  }
+  return 0;
+}
+
+static void apple_fan_curves_free(struct apple_fan_data *data) {
+  int fan;
+
+  // no readers left, the controller and sysfs are gone
+  for (fan = 0; fan < APPLE_MAX_FANS; fan++)
+    kfree(rcu_dereference_protected(data->fan_curve[fan], 1));
+}
+
+static struct apple_fan_curve *apple_fan_curve_dup(struct apple_fan_data *data,
+                                                   int fan) {
+  return kmemdup(rcu_dereference_protected(data->fan_curve[fan],
+                                           lockdep_is_held(&data->curve_lock)),
+                 sizeof(struct apple_fan_curve), GFP_KERNEL);
+}
+
+static void apple_fan_curve_publish(struct apple_fan_data *data, int fan,
+                                    struct apple_fan_curve *curve) {
+  struct apple_fan_curve *old;
+
+  old = rcu_replace_pointer(data->fan_curve[fan], curve,
+                            lockdep_is_held(&data->curve_lock));
+  kfree_rcu(old, rcu);
+}
+
+static int apple_fan_curve_check_points(const struct apple_fan_curve *curve) {
+  const struct apple_fan_curve_point *point;
+  int i;
+
+  if (curve->npoints < 1 || curve->npoints > APPLE_CURVE_MAX_POINTS)
+    return -EINVAL;
+
+  for (i = 0; i < curve->npoints; i++) {
+    point = &curve->points[i];
+    if (point->pwm < 0 || point->pwm > 255)
+      return -EINVAL;
+    if (point->temp < CURVE_TEMP_MIN || point->temp > CURVE_TEMP_MAX)
+      return -EINVAL;
+    if (i && point->temp <= point[-1].temp)
+      return -EINVAL;
+  }
+  return 0;
+}
+
+static int apple_fan_curve_check(struct apple_fan_data *data,
+                                 const struct apple_fan_curve *curve) {
+  int err;
+
+  err = apple_fan_curve_check_points(curve);
+  if (err)
+    return err;
+
+  if (curve->hysteresis < 0 || curve->hysteresis > CURVE_HYST_MAX ||
+      curve->ff_gain < 0 || curve->ff_gain > 255 || curve->ramp < 0 ||
+      curve->ramp > CURVE_RAMP_MAX || curve->sensor < 0 ||
+      curve->sensor >= data->nr_temps)
+    return -EINVAL;
+  return 0;
+}
+
+static int apple_fan_set_curve_mode(struct apple_fan_data *data, int fan) {
+  dbg_msg("fan-id: %d | set curve mode", fan);
+
+  mutex_lock(&data->ec_lock);
+  xchg(&data->pending_speed[fan], -1);
+  data->cooling[fan].active = false;
+  write_seqlock(&data->state_lock);
+  // force the controller to apply the curve on its first run
+  data->fan_states[fan] = -1;
+  data->fan_target[fan] = -1;
+  apple_fan_switch_mode(data, fan, APPLE_FAN_MODE_CURVE);
+  write_sequnlock(&data->state_lock);
+  __apple_fan_invalidate(data);
+  mutex_unlock(&data->ec_lock);
+
+  mod_delayed_work(system_wq, &data->controller, 0);
+  apple_fan_notify(data);
+  return 0;
+}
+
+static void apple_fan_controller_work(struct work_struct *work) {
+  struct apple_fan_data *data =
+      container_of(to_delayed_work(work), struct apple_fan_data, controller);
+  const struct apple_fan_curve *curve;
+  // curve fans whose sensor failed
+  unsigned long lost = 0;
+  unsigned int interval = READ_ONCE(curve_interval);
+  bool active = false, applied = false;
+  int fan, target, temp, level, cur, step;
+
+  // don't rely on a sampler running slower than the controller
+  apple_fan_update_if_older(data, interval);
+
+  level = apple_fan_load_level(&data->load);
+  mutex_lock(&data->ec_lock);
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (data->fan_mode[fan] != APPLE_FAN_MODE_CURVE)
+      continue;
+    active = true;
+
+    // hysteresis only applies to the temperature share of the state
+    cur = data->fan_states[fan];
+    if (cur >= 0)
+      cur = max(cur - data->load.offset[fan], 0);
+
+    rcu_read_lock();
+    curve = rcu_dereference(data->fan_curve[fan]);
+    if (data->temp_status[curve->sensor] != AE_OK) {
+      rcu_read_unlock();
+      lost |= BIT(fan);
+      continue;
+    }
+    temp = data->temp_filtered[curve->sensor] / 1000;
+    target = apple_fan_curve_target(curve, temp, cur);
+    data->load.offset[fan] = curve->ff_gain * level / 100;
+    step = DIV_ROUND_UP(curve->ramp * interval, 1000);
+    rcu_read_unlock();
+
+    target = clamp(target + data->load.offset[fan], data->fan_minimum[fan],
+                   255);
+    // the first run after entering curve mode applies the curve right away
+    if (step && data->fan_states[fan] >= 0)
+      target = clamp(target, data->fan_states[fan] - step,
+                     data->fan_states[fan] + step);
+
+    // only talk to the EC if the output changes by more than the deadband
+    target = __fan_limit_state(data, fan, target, interval);
+    if (target < 0)
+      continue;
+
+    dbg_msg("fan-id: %d | curve: temp %d load %d -> speed %d", fan, temp,
+            level, target);
+    write_seqlock(&data->state_lock);
+    data->fan_states[fan] = target;
+    write_sequnlock(&data->state_lock);
+    __apple_fan_invalidate(data);
+    // re-apply the curve on the next run if the EC missed this one
+    if (fan_set_speed(data, fan, target) != AE_OK) {
+      write_seqlock(&data->state_lock);
+      data->fan_states[fan] = -1;
+      write_sequnlock(&data->state_lock);
+    }
+  }
+
+  // only the curve fans without temperature leave curve mode, auto-mode
+  // switches all fans and is left for when no other fan is claimed
+  if (lost && apple_fan_others_claimed(data, lost)) {
+    applied = true;
+    for (fan = 0; fan < data->nr_fans; fan++) {
+      if (!(lost & BIT(fan)))
+        continue;
+      err_msg("curve",
+              "fan-id: %d | no temperature available, falling back to "
+              "full speed",
+              fan);
+      xchg(&data->pending_speed[fan], -1);
+      __fan_apply_state(data, fan, 255);
+    }
+    lost = 0;
+  }
+  mutex_unlock(&data->ec_lock);
+
+  if (applied)
+    apple_fan_notify(data);
+
+  if (lost) {
+    err_msg("curve", "no temperature available, falling back to auto-mode");
+    fan_set_auto(data);
+    return;
+  }
+
+  if (active)
+    schedule_delayed_work(&data->controller, msecs_to_jiffies(interval));
+}
+
+static int apple_fan_load_sample(struct apple_fan_load *load) {
+  u64 idle = 0, wall = 0, cpu_wall;
+  u64 d_idle, d_wall;
+  unsigned int cur = 0, max = 0;
+  int cpu, util = 0;
+
+  for_each_online_cpu(cpu) {
+    idle += get_cpu_idle_time(cpu, &cpu_wall, 0);
+    wall += cpu_wall;
+    cur += cpufreq_quick_get(cpu);
+    max += cpufreq_quick_get_max(cpu);
+  }
+
+  d_idle = idle - load->idle;
+  d_wall = wall - load->wall;
+  // first sample or cpus went on-/offline, no meaningful interval
+  if (load->wall && wall > load->wall && idle >= load->idle &&
+      d_idle <= d_wall)
+    util = 100 - div64_u64(d_idle * 100, d_wall);
+
+  load->idle = idle;
+  load->wall = wall;
+
+  // a cpu busy at a low clock dissipates far less than at its maximum
+  if (max && cur < max)
+    util = div_u64((u64)util * cur, max);
+  return util;
+}
+
+static int apple_fan_load_level(struct apple_fan_load *load) {
+  load->util = apple_fan_load_sample(load);
+
+  if (load->util < READ_ONCE(load->threshold)) {
+    load->since = 0;
+    return 0;
+  }
+
+  if (!load->since)
+    load->since = jiffies ?: 1;
+  if (time_before(jiffies,
+                  load->since + msecs_to_jiffies(READ_ONCE(load->lead_ms))))
+    return 0;
+  return load->util;
+}
+
+static void apple_fan_read_state(struct apple_fan_data *data, int fan,
+                                 int *state, enum apple_fan_mode *mode) {
+  unsigned int seq;
+
+  do {
+    seq = read_seqbegin(&data->state_lock);
+    *state = data->fan_states[fan];
+    *mode = data->fan_mode[fan];
+  } while (read_seqretry(&data->state_lock, seq));
+}
+
+static int apple_fan_fit_rpm(int state) {
+  u64 s, disc;
+
+  // below the offset of the fit the fan does not turn
+  s = max(state, 0) * FAN_FIT_SCALE;
+  if (s <= FAN_FIT_C)
+    return 0;
+
+  // positive root of the fit solved for rpm, rounded up so that
+  // apple_fan_rpm_to_state() maps it back onto 'state'
+  disc = FAN_FIT_B * FAN_FIT_B + 4 * FAN_FIT_A * (s - FAN_FIT_C);
+  return div64_u64(int_sqrt64(disc) - FAN_FIT_B + 2 * FAN_FIT_A - 1,
+                   2 * FAN_FIT_A);
+}
+
+static void apple_fan_build_table(const struct apple_fan_calib *calib,
+                                  int *table) {
+  const struct apple_fan_calib_point *lo, *hi;
+  int state, i = 0;
+
+  if (!calib->npoints) {
+    for (state = 0; state < APPLE_FAN_STATES; state++)
+      table[state] = apple_fan_fit_rpm(state);
+    return;
+  }
+
+  lo = &calib->points[0];
+  hi = &calib->points[calib->npoints - 1];
+  for (state = 0; state < APPLE_FAN_STATES; state++) {
+    if (state <= lo->pwm) {
+      table[state] = lo->rpm;
+      continue;
+    }
+    if (state >= hi->pwm) {
+      table[state] = hi->rpm;
+      continue;
+    }
+
+    // segment [i, i + 1] containing 'state'
+    while (calib->points[i + 1].pwm < state)
+      i++;
+    table[state] = calib->points[i].rpm +
+                   (calib->points[i + 1].rpm - calib->points[i].rpm) *
+                       (state - calib->points[i].pwm) /
+                       (calib->points[i + 1].pwm - calib->points[i].pwm);
+  }
+}
+
+// models with a measured calibration (e.g. exported from 'fanX_calibration'),
+// all others use the fit - entries look like
+//   {.ident = "MacBookPro16,1",
+//    .matches = {DMI_MATCH(DMI_PRODUCT_NAME, "MacBookPro16,1")},
+//    .driver_data = (void *)&apple_fan_calib_mbp161},
+static const struct dmi_system_id apple_fan_dmi_calib[] = {{}};
+
+static void apple_fan_calib_init(struct apple_fan_data *data) {
+  const struct dmi_system_id *id = dmi_first_match(apple_fan_dmi_calib);
+  const char *param[APPLE_MAX_FANS] = {fan1_calibration, fan2_calibration,
+                                       fan3_calibration, fan4_calibration};
+  struct apple_fan_calib calib;
+  int fan;
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (id)
+      data->calib[fan] = *(const struct apple_fan_calib *)id->driver_data;
+
+    if (param[fan]) {
+      if (apple_fan_parse_calib(param[fan], strlen(param[fan]), &calib) == 0)
+        data->calib[fan] = calib;
+      else
+        warn_msg("init", "fan id: %d | ignoring invalid calibration '%s'",
+                 fan + 1, param[fan]);
+    }
+    apple_fan_build_table(&data->calib[fan], data->rpm_table[fan]);
+  }
+
+  info_msg("init", "fan calibration: %s", id ? id->ident : "generic fit");
+}
+
+static int apple_fan_parse_pair(char *tok, int *a, int *b) {
+  char *sep = strchr(tok, ':');
+
+  if (!sep)
+    return -EINVAL;
+  *sep = '\0';
+  if (kstrtoint(tok, 10, a) || kstrtoint(sep + 1, 10, b))
+    return -EINVAL;
+  return 0;
+}
+
+static int apple_fan_parse_calib(const char *buf, size_t count,
+                                 struct apple_fan_calib *calib) {
+  struct apple_fan_calib_point *point;
+  char *str, *cur, *tok;
+  int err = -EINVAL;
+
+  memset(calib, 0, sizeof(*calib));
+
+  str = kstrndup(buf, count, GFP_KERNEL);
+  if (!str)
+    return -ENOMEM;
+
+  cur = str;
+  while ((tok = strsep(&cur, " ,\t\n")) != NULL) {
+    if (!*tok)
+      continue;
+
+    if (calib->npoints == APPLE_CALIB_MAX_POINTS)
+      goto out;
+
+    point = &calib->points[calib->npoints];
+    if (apple_fan_parse_pair(tok, &point->pwm, &point->rpm))
+      goto out;
+    if (point->pwm < 0 || point->pwm > 255 || point->rpm < 0)
+      goto out;
+    // the table must stay monotonic for the binary search
+    if (calib->npoints && (point->pwm <= point[-1].pwm ||
+                           point->rpm < point[-1].rpm))
+      goto out;
+
+    calib->npoints++;
+  }
+  err = 0;
+out:
+  kfree(str);
+  return err;
+}
+
+static int apple_fan_set_calib(struct apple_fan_data *data, int fan,
+                               const struct apple_fan_calib *calib) {
+  int *table;
+
+  // built outside of the seqlock, readers only wait for the copy
+  table = kmalloc_array(APPLE_FAN_STATES, sizeof(*table), GFP_KERNEL);
+  if (!table)
+    return -ENOMEM;
+  apple_fan_build_table(calib, table);
+
+  mutex_lock(&data->ec_lock);
+  write_seqlock(&data->state_lock);
+  data->calib[fan] = *calib;
+  memcpy(data->rpm_table[fan], table, sizeof(data->rpm_table[fan]));
+  write_sequnlock(&data->state_lock);
+  // rpm reported in manual mode is taken from the table
+  __apple_fan_invalidate(data);
+  mutex_unlock(&data->ec_lock);
+
+  kfree(table);
+  return 0;
+}
+
+static unsigned int apple_fan_rpm_to_state(const int *table, int rpm) {
+  unsigned int lo = 0, hi = APPLE_FAN_STATES - 1, mid;
+
+  // stopped fan or failed read
+  if (rpm <= 0)
+    return 0;
+
+  // first state reaching 'rpm', faster than the table is still full speed
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (table[mid] < rpm)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  // ... or the state below if that one is closer
+  if (lo && rpm - table[lo - 1] < table[lo] - rpm)
+    lo--;
+  return lo;
+}
+
+static int apple_fan_state_to_rpm(const int *table, int state) {
+  if (state < 0)
+    return 0;
+  return table[min(state, APPLE_FAN_STATES - 1)];
+}
+
+// fan state of sweep step 'step', evenly spread over 0 - 255
+static int apple_fan_sweep_pwm(int step) {
+  return step * 255 / (APPLE_CALIB_MAX_POINTS - 1);
+}
+
+// switch to the state of the current step and wait for it to settle
+static void apple_fan_sweep_next(struct apple_fan_sweep *sweep) {
+  __fan_set_cur_state(sweep->data, sweep->fan,
+                      apple_fan_sweep_pwm(sweep->step));
+
+  sweep->last_rpm = -1;
+  sweep->stable = 0;
+  sweep->deadline = jiffies + msecs_to_jiffies(SWEEP_TIMEOUT_MS);
+  schedule_delayed_work(&sweep->work, msecs_to_jiffies(SWEEP_POLL_MS));
+}
+
+static bool apple_fan_sweep_plausible(const struct apple_fan_calib *calib) {
+  const struct apple_fan_calib_point *point = calib->points;
+  int i, rises = 0;
+
+  if (calib->npoints < 2 ||
+      point[calib->npoints - 1].rpm - point[0].rpm < SWEEP_MIN_SPAN_RPM)
+    return false;
+
+  for (i = 1; i < calib->npoints; i++) {
+    if (point[i].rpm > point[i - 1].rpm)
+      rises++;
+  }
+  return rises >= SWEEP_MIN_RISES;
+}
+
+static int apple_fan_sweep_start(struct apple_fan_data *data, int fan) {
+  struct apple_fan_sweep *sweep = &data->sweep[fan];
+  int err = 0;
+
+  mutex_lock(&data->sweep_lock);
+  if (sweep->status == APPLE_SWEEP_RUNNING) {
+    err = -EBUSY;
+    goto out;
+  }
+
+  apple_fan_read_state(data, fan, &sweep->saved_state, &sweep->saved_mode);
+  memset(&sweep->calib, 0, sizeof(sweep->calib));
+  sweep->step = 0;
+  sweep->status = APPLE_SWEEP_RUNNING;
+
+  info_msg("calibrate", "fan id: %d | starting calibration sweep", fan + 1);
+  apple_fan_sweep_next(sweep);
+out:
+  mutex_unlock(&data->sweep_lock);
+  return err;
+}
+
+static void apple_fan_sweep_abort(struct apple_fan_data *data, int fan) {
+  struct apple_fan_sweep *sweep = &data->sweep[fan];
+  bool running;
+
+  mutex_lock(&data->sweep_lock);
+  running = sweep->status == APPLE_SWEEP_RUNNING;
+  if (running)
+    sweep->status = APPLE_SWEEP_ABORTED;
+  mutex_unlock(&data->sweep_lock);
+
+  // the worker bails out on its own once it sees the new status
+  cancel_delayed_work_sync(&sweep->work);
+  if (running)
+    apple_fan_sweep_restore(sweep);
+}
+
+static void apple_fan_sweep_work(struct work_struct *work) {
+  struct apple_fan_sweep *sweep =
+      container_of(to_delayed_work(work), struct apple_fan_sweep, work);
+  struct apple_fan_data *data = sweep->data;
+  struct apple_fan_calib_point *point;
+  unsigned long long value;
+  acpi_status ret;
+  int rpm;
+
+  mutex_lock(&data->sweep_lock);
+  if (sweep->status != APPLE_SWEEP_RUNNING)
+    goto out;
+
+  // low states barely cool, stop before the machine gets hot
+  apple_fan_update_if_older(data, SWEEP_POLL_MS);
+  if (data->temp_status[0] != AE_OK || data->temp1_max_alarm) {
+    err_msg("calibrate", "fan id: %d | temperature too high or unknown",
+            sweep->fan + 1);
+    goto fail;
+  }
+
+  // ask the EC directly, the cached rpm is derived from the state in
+  // manual mode
+  mutex_lock(&data->ec_lock);
+  ret = data->backend->read_rpm(data, sweep->fan, &value);
+  mutex_unlock(&data->ec_lock);
+  if (ret != AE_OK) {
+    err_msg("calibrate", "fan id: %d | reading rpm failed, errcode: %s",
+            sweep->fan + 1, acpi_format_exception(ret));
+    goto fail;
+  }
+
+  rpm = value;
+  if (sweep->last_rpm >= 0 && abs(rpm - sweep->last_rpm) <= SWEEP_SETTLE_RPM)
+    sweep->stable++;
+  else
+    sweep->stable = 0;
+  sweep->last_rpm = rpm;
+
+  if (sweep->stable < SWEEP_SETTLE_READS &&
+      time_before(jiffies, sweep->deadline)) {
+    schedule_delayed_work(&sweep->work, msecs_to_jiffies(SWEEP_POLL_MS));
+    goto out;
+  }
+
+  point = &sweep->calib.points[sweep->step];
+  point->pwm = apple_fan_sweep_pwm(sweep->step);
+  point->rpm = rpm;
+  sweep->calib.npoints++;
+  dbg_msg("fan-id: %d | calibration: state %d -> %d RPM", sweep->fan,
+          point->pwm, point->rpm);
+
+  if (++sweep->step < APPLE_CALIB_MAX_POINTS) {
+    apple_fan_sweep_next(sweep);
+    goto out;
+  }
+
+  // the readings must follow the state, the current table is kept otherwise
+  if (!apple_fan_sweep_plausible(&sweep->calib)) {
+    err_msg("calibrate", "fan id: %d | measured speed does not follow the "
+                         "fan state, keeping the current calibration",
+            sweep->fan + 1);
+    goto fail;
+  }
+
+  // keep the table monotonic, measurement noise must not break the search
+  for (point = &sweep->calib.points[1];
+       point < &sweep->calib.points[sweep->calib.npoints]; point++)
+    point->rpm = max(point->rpm, point[-1].rpm);
+
+  if (apple_fan_set_calib(data, sweep->fan, &sweep->calib))
+    goto fail;
+  sweep->status = APPLE_SWEEP_DONE;
+  info_msg("calibrate", "fan id: %d | calibration sweep finished",
+           sweep->fan + 1);
+  apple_fan_sweep_restore(sweep);
+  goto out;
+
+fail:
+  sweep->status = APPLE_SWEEP_FAILED;
+  apple_fan_sweep_restore(sweep);
+out:
+  mutex_unlock(&data->sweep_lock);
+}
+
+static void apple_fan_sweep_restore(struct apple_fan_sweep *sweep) {
+  struct apple_fan_data *data = sweep->data;
+
+  switch (sweep->saved_mode) {
+  case APPLE_FAN_MODE_MANUAL:
+    __fan_set_cur_state(data, sweep->fan, sweep->saved_state);
+    break;
+  case APPLE_FAN_MODE_CURVE:
+    apple_fan_set_curve_mode(data, sweep->fan);
+    break;
+  default:
+    // auto-mode switches all fans, keep the minimum if another one is
+    // controlled by the user
+    if (!apple_fan_others_claimed(data, BIT(sweep->fan)))
+      fan_set_auto(data);
+    else
+      __fan_set_cur_state(data, sweep->fan, data->fan_minimum[sweep->fan]);
+    break;
+  }
+}
+
+static bool apple_fan_sweeping(struct apple_fan_data *data, int fan) {
+  return READ_ONCE(data->sweep[fan].status) == APPLE_SWEEP_RUNNING;
+}
+
+static bool apple_fan_any_sweeping(struct apple_fan_data *data) {
+  int fan;
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (apple_fan_sweeping(data, fan))
+      return true;
+  }
+  return false;
+}
+
+static int apple_fan_user_set_auto(struct apple_fan_data *data) {
+  int err = 0;
+
+  // no sweep can start in between
+  mutex_lock(&data->sweep_lock);
+  if (apple_fan_any_sweeping(data))
+    err = -EBUSY;
+  else if (fan_set_auto(data) != AE_OK)
+    err = -EIO;
+  mutex_unlock(&data->sweep_lock);
+  return err;
+}
+
+static bool apple_fan_others_claimed(struct apple_fan_data *data,
+                                     unsigned long fans) {
+  enum apple_fan_mode mode;
+  int other, state;
+
+  for (other = 0; other < data->nr_fans; other++) {
+    if (fans & BIT(other))
+      continue;
+    // fans held by the thermal framework are given back anyway
+    apple_fan_read_state(data, other, &state, &mode);
+    if (mode != APPLE_FAN_MODE_AUTO && !READ_ONCE(data->cooling[other].active))
+      return true;
+  }
+  return false;
+}
+
+static unsigned long __fan_cached_state(struct apple_fan_data *data, int fan) {
+  enum apple_fan_mode mode;
+  unsigned int seq, state;
+  int set_state;
+
+  // curve mode reports -1 until the controller applied the curve once
+  apple_fan_read_state(data, fan, &set_state, &mode);
+  if (mode != APPLE_FAN_MODE_AUTO && set_state >= 0)
+    return set_state;
+
+  do {
+    seq = read_seqbegin(&data->state_lock);
+    state = apple_fan_rpm_to_state(data->rpm_table[fan], data->fan_rpm[fan]);
+  } while (read_seqretry(&data->state_lock, seq));
+  return state;
+}
+
+static int __fan_get_cur_state(struct apple_fan_data *data, int fan,
+                               unsigned long *state) {
+  enum apple_fan_mode mode;
+  int set_state;
+
+  dbg_msg("fan-id: %d | get state", fan);
+
+  // a queued setpoint is what the fan is about to run at
+  set_state = READ_ONCE(data->pending_speed[fan]);
+  if (set_state >= 0) {
+    *state = set_state;
+    return 0;
+  }
+
+  // a set state is known without waiting for a sensor refresh, it is unknown
+  // (-1) after a failed write
+  apple_fan_read_state(data, fan, &set_state, &mode);
+  if (mode != APPLE_FAN_MODE_AUTO && set_state >= 0) {
+    *state = set_state;
+    return 0;
+  }
+
+  apple_fan_update_fan_if_stale(data, fan);
+  *state = __fan_cached_state(data, fan);
+  return 0;
+}
+
+static int __fan_set_cur_state(struct apple_fan_data *data, int fan,
+                               unsigned long state) {
+  int ret;
+
+  dbg_msg("fan-id: %d | set state: %lu", fan, state);
+  // catch illegal state set
+  if (state > 255) {
+    warn_msg("set pwm", "fan-id: %d | illegal value provided: %lu", fan,
+             state);
+    return 1;
+  }
+
+  mutex_lock(&data->ec_lock);
+  // a setpoint still queued by an earlier store must not win over this one,
+  // nor its slew
+  xchg(&data->pending_speed[fan], -1);
+  data->fan_target[fan] = -1;
+  ret = __fan_apply_state(data, fan, state);
+  mutex_unlock(&data->ec_lock);
+
+  apple_fan_notify(data);
+  return ret;
+}
+
+static int __fan_apply_state(struct apple_fan_data *data, int fan,
+                             unsigned long state) {
+  int ret;
+
+  lockdep_assert_held(&data->ec_lock);
+
+  // the thermal framework re-claims the fan after calling us
+  data->cooling[fan].active = false;
+
+  write_seqlock(&data->state_lock);
+  data->fan_states[fan] = state;
+  apple_fan_switch_mode(data, fan, APPLE_FAN_MODE_MANUAL);
+  write_sequnlock(&data->state_lock);
+  // cached rpm is derived from the mode, don't report it until refreshed
+  __apple_fan_invalidate(data);
+  ret = fan_set_speed(data, fan, state);
+  if (ret != AE_OK) {
+    // unknown now, an identical retry must reach the EC again
+    write_seqlock(&data->state_lock);
+    data->fan_states[fan] = -1;
+    write_sequnlock(&data->state_lock);
+  }
+  return ret;
+}
+
+static void apple_fan_queue_speed(struct apple_fan_data *data, int fan,
+                                  unsigned long state) {
+  dbg_msg("fan-id: %d | queue state: %lu", fan, state);
+
+  // a setpoint not yet picked up is simply replaced, the work is queued once
+  xchg(&data->pending_speed[fan], state);
+  // a pending slew step keeps its time, stores don't speed up the ramp
+  queue_delayed_work(data->wq, &data->speed[fan].work, 0);
+}
+
+static void apple_fan_speed_work(struct work_struct *work) {
+  struct apple_fan_speed *speed =
+      container_of(to_delayed_work(work), struct apple_fan_speed, work);
+  struct apple_fan_data *data = speed->data;
+  int fan = speed->fan;
+  enum apple_fan_mode mode;
+  bool again = false;
+  acpi_status ret;
+  int state, next;
+
+  mutex_lock(&data->ec_lock);
+  // taken under 'ec_lock', so mode changes in between drop it for good
+  state = xchg(&data->pending_speed[fan], -1);
+  if (state < 0)
+    goto out;
+
+  // deadband and slew limit only apply while the fan stays in manual mode
+  mode = data->fan_mode[fan];
+  if (mode == APPLE_FAN_MODE_MANUAL && !data->cooling[fan].active) {
+    next = __fan_limit_state(data, fan, state, FAN_SLEW_PERIOD);
+    if (next < 0) {
+      dbg_msg("fan-id: %d | state %d dropped", fan, state);
+      goto out;
+    }
+    // the rest of the way, unless a newer store replaced it meanwhile
+    if (next != state) {
+      cmpxchg(&data->pending_speed[fan], -1, state);
+      again = true;
+    }
+    state = next;
+  }
+
+  ret = __fan_apply_state(data, fan, state);
+  if (ret != AE_OK) {
+    err_msg("set pwm", "fan-id: %d | failed setting state %d, errcode: %s",
+            fan, state, acpi_format_exception(ret));
+    if (data->speed_err == AE_OK)
+      data->speed_err = ret;
+  }
+out:
+  mutex_unlock(&data->ec_lock);
+
+  if (again)
+    queue_delayed_work(data->wq, &speed->work,
+                       msecs_to_jiffies(FAN_SLEW_PERIOD));
+  apple_fan_notify(data);
+}
+
+static int __fan_limit_state(struct apple_fan_data *data, int fan, int target,
+                             unsigned int period_ms) {
+  unsigned int slew = READ_ONCE(data->fan_slew[fan]);
+  unsigned int deadband = READ_ONCE(data->fan_deadband[fan]);
+  int cur = data->fan_states[fan];
+  bool slewing;
+  int step;
+
+  lockdep_assert_held(&data->ec_lock);
+
+  // nothing applied yet (e.g. entering curve mode), go straight there
+  if (cur < 0) {
+    data->fan_target[fan] = target;
+    return target;
+  }
+
+  if (target == cur) {
+    data->fan_target[fan] = target;
+    data->writes[fan].unchanged++;
+    return -1;
+  }
+
+  // the deadband holds back new moves, not the rest of a slew-limited one,
+  // and never keeps the fan from its bounds
+  slewing = data->fan_target[fan] >= 0 && data->fan_target[fan] != cur;
+  if (!slewing && abs(target - cur) < deadband && target != 255 &&
+      target != data->fan_minimum[fan]) {
+    data->writes[fan].deadband++;
+    return -1;
+  }
+  data->fan_target[fan] = target;
+
+  if (slew) {
+    step = max_t(int, DIV_ROUND_UP(slew * period_ms, 1000), 1);
+    if (abs(target - cur) > step) {
+      data->writes[fan].slewed++;
+      target = target > cur ? cur + step : cur - step;
+    }
+  }
+  return target;
+}
+
+static acpi_status apple_fan_flush_speed(struct apple_fan_data *data) {
+  acpi_status ret;
+  int fan;
+
+  // a slew step waiting for its time is not forced early (that would undo the
+  // slew limit of clients syncing after every store), such setpoints keep
+  // ramping in the background afterwards
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (!timer_pending(&data->speed[fan].work.timer))
+      flush_work(&data->speed[fan].work.work);
+  }
+
+  mutex_lock(&data->ec_lock);
+  ret = data->speed_err;
+  data->speed_err = AE_OK;
+  mutex_unlock(&data->ec_lock);
+  return ret;
+}
+
+static int __fan_get_cur_control_state(struct apple_fan_data *data, int fan,
+                                       int *state) {
+  enum apple_fan_mode mode;
+  int set_state;
+
+  dbg_msg("fan-id: %d | get control state", fan);
+  apple_fan_read_state(data, fan, &set_state, &mode);
+  *state = mode;
+  return 0;
+}
+
+static int __fan_set_cur_control_state(struct apple_fan_data *data, int fan,
+                                       int state) {
+  enum apple_fan_mode mode;
+  int cur;
+
+  dbg_msg("fan-id: %d | set control state: %d", fan, state);
+  if (state == APPLE_FAN_MODE_AUTO) {
+    return fan_set_auto(data);
+  }
+  if (state == APPLE_FAN_MODE_CURVE)
+    return apple_fan_set_curve_mode(data, fan);
+  if (state != APPLE_FAN_MODE_MANUAL)
+    return 1;
+
+  // hold the fan where it is (e.g. the last curve output), unknown or auto
+  // starts at the midpoint like fanX_mode 'manual'
+  apple_fan_read_state(data, fan, &cur, &mode);
+  if (mode == APPLE_FAN_MODE_MANUAL && cur >= 0)
+    return 0;
+  if (mode == APPLE_FAN_MODE_AUTO || cur < 0)
+    cur = (255 - data->fan_minimum[fan]) >> 1;
+  return __fan_set_cur_state(data, fan, cur);
+}
+
+static int fan_set_speed(struct apple_fan_data *data, int fan, int speed) {
+
+  dbg_msg("fan-id: %d | set speed: %d", fan, speed);
+  trace_apple_fan_set_speed(fan, speed);
+  data->writes[fan].applied++;
+
+  return data->backend->set_speed(data, fan, speed);
+}
+
+static acpi_status __fan_rpm(struct apple_fan_data *data, int fan, int *rpm) {
+  unsigned long long value;
+  acpi_status ret;
+
+  dbg_msg("fan-id: %d | get RPM", fan);
+
+  // fan does not report during manual speed setting - so fake it!
+  // - unless the last write failed and the state is unknown
+  if (data->fan_mode[fan] != APPLE_FAN_MODE_AUTO &&
+      data->fan_states[fan] >= 0) {
+    value = apple_fan_state_to_rpm(data->rpm_table[fan],
+                                   data->fan_states[fan]);
+
+    dbg_msg("|--> get RPM for manual mode, calculated: %llu", value);
+  } else {
+    dbg_msg("|--> get RPM using %s backend", data->backend->name);
+
+    ret = data->backend->read_rpm(data, fan, &value);
+    dbg_msg("|--> request returned: %s", acpi_format_exception(ret));
+
+    if (ret != AE_OK) {
+      *rpm = -1;
+      return ret;
+    }
+  }
+  *rpm = (int)value;
+  return AE_OK;
+}
+
+static ssize_t fan_get_mode(struct device *dev, struct device_attribute *attr,
+                            char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  enum apple_fan_mode mode;
+  int state;
+
+  apple_fan_read_state(data, fan, &state, &mode);
+  if (mode == APPLE_FAN_MODE_CURVE)
+    return sprintf(buf, "%s\n", fan_mode_curve_string);
+  else if (mode == APPLE_FAN_MODE_MANUAL)
+    return sprintf(buf, "%s\n", fan_mode_manual_string);
+  else
+    return sprintf(buf, "%s\n", fan_mode_auto_string);
+}
+
+static ssize_t fan_set_mode(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return _fan_set_mode(data, to_sensor_dev_attr(attr)->index, buf, count);
+}
+
+static ssize_t _fan_set_mode(struct apple_fan_data *data, int fan,
+                             const char *buf, size_t count) {
+  int ret;
+
+  if (apple_fan_sweeping(data, fan))
+    return -EBUSY;
+
+  // whole words only (sysfs_streq() ignores the trailing newline), prefixes
+  // like "autoxyz" or "0manual" used to be accepted
+  if (sysfs_streq(buf, fan_mode_auto_string) || sysfs_streq(buf, "0")) {
+    ret = apple_fan_user_set_auto(data);
+    return ret ? ret : count;
+  }
+
+  if (sysfs_streq(buf, fan_mode_manual_string))
+    ret = __fan_set_cur_state(data, fan, (255 - data->fan_minimum[fan]) >> 1);
+  else if (sysfs_streq(buf, fan_mode_curve_string))
+    ret = apple_fan_set_curve_mode(data, fan);
+  else {
+    err_msg("set mode",
+            "fan id: %d | setting mode to '%s', use 'auto', 'manual' or "
+            "'curve'",
+            fan + 1, buf);
+    return -EINVAL;
+  }
+
+  return ret == AE_OK ? count : -EIO;
+}
+
+static ssize_t fan_get_speed(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned long state = 0;
+
+  __fan_get_cur_state(data, to_sensor_dev_attr(attr)->index, &state);
+  return sprintf(buf, "%lu\n", state);
+}
+
+static ssize_t fan_set_speed_attr(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int state;
+  int err;
+
+  err = kstrtouint(buf, 10, &state);
+  if (err)
+    return err;
+  if (state > 255)
+    return -EINVAL;
+  if (apple_fan_sweeping(data, to_sensor_dev_attr(attr)->index))
+    return -EBUSY;
+
+  // errors are reported through fan_sync
+  apple_fan_queue_speed(data, to_sensor_dev_attr(attr)->index, state);
+  return count;
+}
+
+static ssize_t fan_get_curve(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  const struct apple_fan_curve *curve;
+  ssize_t len = 0;
+  int i;
+
+  rcu_read_lock();
+  curve = rcu_dereference(data->fan_curve[to_sensor_dev_attr(attr)->index]);
+  for (i = 0; i < curve->npoints; i++)
+    len += sprintf(buf + len, "%s%d:%d", i ? " " : "", curve->points[i].temp,
+                   curve->points[i].pwm);
+  rcu_read_unlock();
+
+  len += sprintf(buf + len, "\n");
+  return len;
+}
+
+// format: "<temp>:<pwm> <temp>:<pwm> ...", temperatures (degree celsius)
+// strictly ascending within CURVE_TEMP_MIN - CURVE_TEMP_MAX, pwm 0 - 255, at
+// most APPLE_CURVE_MAX_POINTS points
+static int apple_fan_parse_curve(const char *buf, size_t count,
+                                 struct apple_fan_curve *curve) {
+  struct apple_fan_curve_point *point;
+  char *str, *cur, *tok;
+  int err = -EINVAL;
+
+  memset(curve, 0, sizeof(*curve));
+
+  str = kstrndup(buf, count, GFP_KERNEL);
+  if (!str)
+    return -ENOMEM;
+
+  cur = str;
+  while ((tok = strsep(&cur, " \t\n")) != NULL) {
+    if (!*tok)
+      continue;
+
+    if (curve->npoints == APPLE_CURVE_MAX_POINTS)
+      goto out;
+
+    point = &curve->points[curve->npoints];
+    if (apple_fan_parse_pair(tok, &point->temp, &point->pwm))
+      goto out;
+
+    curve->npoints++;
+  }
+  // same validation as the binary fanX_curve_table
+  err = apple_fan_curve_check_points(curve);
+out:
+  kfree(str);
+  return err;
+}
+
+static ssize_t fan_set_curve(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  struct apple_fan_curve curve;
+  struct apple_fan_curve *new;
+  int err;
+
+  err = apple_fan_parse_curve(buf, count, &curve);
+  if (err)
+    return err;
+
+  mutex_lock(&data->curve_lock);
+  new = apple_fan_curve_dup(data, fan);
+  if (!new) {
+    mutex_unlock(&data->curve_lock);
+    return -ENOMEM;
+  }
+  new->npoints = curve.npoints;
+  memcpy(new->points, curve.points, sizeof(curve.points));
+  apple_fan_curve_publish(data, fan, new);
+  mutex_unlock(&data->curve_lock);
+  return count;
+}
+
+static ssize_t fan_get_curve_hyst(struct device *dev,
+                                  struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int hyst;
+
+  rcu_read_lock();
+  hyst = rcu_dereference(data->fan_curve[to_sensor_dev_attr(attr)->index])
+             ->hysteresis;
+  rcu_read_unlock();
+  return sprintf(buf, "%d\n", hyst);
+}
+
+static ssize_t fan_set_curve_hyst(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  struct apple_fan_curve *new;
+  unsigned int hyst;
+  int err;
+
+  err = kstrtouint(buf, 10, &hyst);
+  if (err)
+    return err;
+  if (hyst > CURVE_HYST_MAX)
+    return -EINVAL;
+
+  mutex_lock(&data->curve_lock);
+  new = apple_fan_curve_dup(data, fan);
+  if (!new) {
+    mutex_unlock(&data->curve_lock);
+    return -ENOMEM;
+  }
+  new->hysteresis = hyst;
+  apple_fan_curve_publish(data, fan, new);
+  mutex_unlock(&data->curve_lock);
+  return count;
+}
+
+static ssize_t fan_get_ff_gain(struct device *dev,
+                               struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int gain;
+
+  rcu_read_lock();
+  gain = rcu_dereference(data->fan_curve[to_sensor_dev_attr(attr)->index])
+             ->ff_gain;
+  rcu_read_unlock();
+  return sprintf(buf, "%d\n", gain);
+}
+
+static ssize_t fan_set_ff_gain(struct device *dev,
+                               struct device_attribute *attr, const char *buf,
+                               size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  struct apple_fan_curve *new;
+  unsigned int gain;
+  int err;
+
+  err = kstrtouint(buf, 10, &gain);
+  if (err)
+    return err;
+  if (gain > 255)
+    return -EINVAL;
+
+  mutex_lock(&data->curve_lock);
+  new = apple_fan_curve_dup(data, fan);
+  if (!new) {
+    mutex_unlock(&data->curve_lock);
+    return -ENOMEM;
+  }
+  new->ff_gain = gain;
+  apple_fan_curve_publish(data, fan, new);
+  mutex_unlock(&data->curve_lock);
+  return count;
+}
+
+static ssize_t fan_get_ff_threshold(struct device *dev,
+                                    struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(buf, "%u\n", data->load.threshold);
+}
+
+static ssize_t fan_set_ff_threshold(struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int threshold;
+  int err;
+
+  err = kstrtouint(buf, 10, &threshold);
+  if (err)
+    return err;
+  if (threshold > 100)
+    return -EINVAL;
+
+  WRITE_ONCE(data->load.threshold, threshold);
+  return count;
+}
+
+static ssize_t fan_get_ff_lead(struct device *dev,
+                               struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(buf, "%u\n", data->load.lead_ms);
+}
+
+static ssize_t fan_set_ff_lead(struct device *dev,
+                               struct device_attribute *attr, const char *buf,
+                               size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int lead;
+  int err;
+
+  err = kstrtouint(buf, 10, &lead);
+  if (err)
+    return err;
+  if (lead > FF_LEAD_MAX)
+    return -EINVAL;
+
+  WRITE_ONCE(data->load.lead_ms, lead);
+  return count;
+}
+
+static ssize_t fan_get_ff_load(struct device *dev,
+                               struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(buf, "%d\n", READ_ONCE(data->load.util));
+}
+
+static ssize_t fan_get_slew(struct device *dev, struct device_attribute *attr,
+                            char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(buf, "%u\n",
+                 READ_ONCE(data->fan_slew[to_sensor_dev_attr(attr)->index]));
+}
+
+static ssize_t fan_set_slew(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int slew;
+  int err;
+
+  err = kstrtouint(buf, 10, &slew);
+  if (err)
+    return err;
+  if (slew > FAN_SLEW_MAX)
+    return -EINVAL;
+
+  WRITE_ONCE(data->fan_slew[to_sensor_dev_attr(attr)->index], slew);
+  return count;
+}
+
+static ssize_t fan_get_deadband(struct device *dev,
+                                struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(
+      buf, "%u\n",
+      READ_ONCE(data->fan_deadband[to_sensor_dev_attr(attr)->index]));
+}
+
+static ssize_t fan_set_deadband(struct device *dev,
+                                struct device_attribute *attr, const char *buf,
+                                size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int deadband;
+  int err;
+
+  err = kstrtouint(buf, 10, &deadband);
+  if (err)
+    return err;
+  if (deadband > FAN_DEADBAND_MAX)
+    return -EINVAL;
+
+  WRITE_ONCE(data->fan_deadband[to_sensor_dev_attr(attr)->index], deadband);
+  return count;
+}
+
+static ssize_t fan_get_temp_ema(struct device *dev,
+                                struct device_attribute *attr, char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  return sprintf(buf, "%u\n", READ_ONCE(data->temp_ema));
+}
+
+// percent of the readings of one TEMP_EMA_PERIOD_MS in the filtered
+// temperature, 100 = off
+static ssize_t fan_set_temp_ema(struct device *dev,
+                                struct device_attribute *attr, const char *buf,
+                                size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned int ema;
+  int err;
+
+  err = kstrtouint(buf, 10, &ema);
+  if (err)
+    return err;
+  if (ema < 1 || ema > 100)
+    return -EINVAL;
+
+  WRITE_ONCE(data->temp_ema, ema);
+  return count;
+}
+
+static ssize_t fan_read_curve_table(struct file *file, struct kobject *kobj,
+                                    struct bin_attribute *attr, char *buf,
+                                    loff_t off, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+  struct apple_fan_curve_table table = {.version = APPLE_CURVE_TABLE_VERSION};
+  const struct apple_fan_curve *curve;
+  int i;
+
+  rcu_read_lock();
+  curve = rcu_dereference(data->fan_curve[(long)attr->private]);
+  table.npoints = curve->npoints;
+  for (i = 0; i < curve->npoints; i++) {
+    table.points[i].temp = curve->points[i].temp;
+    table.points[i].pwm = curve->points[i].pwm;
+  }
+  table.hysteresis = curve->hysteresis;
+  table.ff_gain = curve->ff_gain;
+  table.ramp = curve->ramp;
+  table.sensor = curve->sensor;
+  rcu_read_unlock();
+
+  return memory_read_from_buffer(buf, count, &off, &table, sizeof(table));
+}
+
+static ssize_t fan_write_curve_table(struct file *file, struct kobject *kobj,
+                                     struct bin_attribute *attr, char *buf,
+                                     loff_t off, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+  int fan = (long)attr->private;
+  struct apple_fan_curve_table table;
+  struct apple_fan_curve *curve;
+  int i, err;
+
+  // partial updates would publish a half-written curve
+  if (off || count != sizeof(table))
+    return -EINVAL;
+  memcpy(&table, buf, sizeof(table));
+  if (table.version != APPLE_CURVE_TABLE_VERSION ||
+      table.npoints > APPLE_CURVE_MAX_POINTS)
+    return -EINVAL;
+
+  curve = kzalloc(sizeof(*curve), GFP_KERNEL);
+  if (!curve)
+    return -ENOMEM;
+
+  curve->npoints = table.npoints;
+  for (i = 0; i < table.npoints; i++) {
+    curve->points[i].temp = table.points[i].temp;
+    curve->points[i].pwm = table.points[i].pwm;
+  }
+  // values beyond INT_MAX turn negative here and fail the check as well
+  curve->hysteresis = table.hysteresis;
+  curve->ff_gain = table.ff_gain;
+  curve->ramp = table.ramp;
+  curve->sensor = table.sensor;
+
+  err = apple_fan_curve_check(data, curve);
+  if (err) {
+    kfree(curve);
+    return err;
+  }
+
+  dbg_msg("fan-id: %d | new curve table, %d points", fan, curve->npoints);
+  mutex_lock(&data->curve_lock);
+  apple_fan_curve_publish(data, fan, curve);
+  mutex_unlock(&data->curve_lock);
+  return count;
+}
+
+static ssize_t fan_get_calib(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  struct apple_fan_calib calib;
+  unsigned int seq;
+  ssize_t len = 0;
+  int i;
+
+  do {
+    seq = read_seqbegin(&data->state_lock);
+    calib = data->calib[fan];
+  } while (read_seqretry(&data->state_lock, seq));
+
+  for (i = 0; i < calib.npoints; i++)
+    len += sprintf(buf + len, "%s%d:%d", i ? " " : "", calib.points[i].pwm,
+                   calib.points[i].rpm);
+
+  len += sprintf(buf + len, "\n");
+  return len;
+}
+
+static ssize_t fan_set_calib(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  struct apple_fan_calib calib;
+  int err;
+
+  // an empty write returns to the built-in fit
+  err = apple_fan_parse_calib(buf, count, &calib);
+  if (err)
+    return err;
+
+  err = apple_fan_set_calib(data, to_sensor_dev_attr(attr)->index, &calib);
+  return err ? err : count;
+}
+
+static ssize_t fan_get_sweep(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  struct apple_fan_sweep *sweep = &data->sweep[to_sensor_dev_attr(attr)->index];
+  ssize_t len;
+
+  mutex_lock(&data->sweep_lock);
+  switch (sweep->status) {
+  case APPLE_SWEEP_RUNNING:
+    len = sprintf(buf, "running %d/%d\n", sweep->step,
+                  APPLE_CALIB_MAX_POINTS);
+    break;
+  case APPLE_SWEEP_DONE:
+    len = sprintf(buf, "done\n");
+    break;
+  case APPLE_SWEEP_FAILED:
+    len = sprintf(buf, "failed\n");
+    break;
+  case APPLE_SWEEP_ABORTED:
+    len = sprintf(buf, "aborted\n");
+    break;
+  default:
+    len = sprintf(buf, "idle\n");
+    break;
+  }
+  mutex_unlock(&data->sweep_lock);
+  return len;
+}
+
+static ssize_t fan_set_sweep(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  int fan = to_sensor_dev_attr(attr)->index;
+  bool start;
+  int err;
+
+  err = kstrtobool(buf, &start);
+  if (err)
+    return err;
+
+  if (!start) {
+    apple_fan_sweep_abort(data, fan);
+    return count;
+  }
+
+  err = apple_fan_sweep_start(data, fan);
+  return err ? err : count;
+}
+
+static ssize_t fan_set_sync(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  if (apple_fan_flush_speed(data) != AE_OK)
+    return -EIO;
+  return count;
+}
+
+// TODO: Reading the correct max fan speed does not work!
+static int fan_get_max_speed(struct apple_fan_data *data,
+                             unsigned long *state) {
+
+  unsigned int seq;
+
+  dbg_msg("fan-id: (both) | get max speed");
+  do {
+    seq = read_seqbegin(&data->state_lock);
+    *state = data->max_fan_speed_setting;
+  } while (read_seqretry(&data->state_lock, seq));
+  return 0;
+}
+
+static int fan_set_max_speed(struct apple_fan_data *data, unsigned long state,
+                             bool reset) {
+  acpi_status ret;
+
+  dbg_msg("fan-id: (both) | set max speed: %lu, force reset: %d", state,
+          (unsigned int)reset);
+
+  mutex_lock(&data->ec_lock);
+
+  // if reset is 'true' ignore anything else and reset to
+  // -> auto-mode with max-speed
+  // -> use "SB.ARKD.QMOD" _without_ "SB.QFAN",
+  //    which seems not writeable as expected
+  if (reset) {
+    state = 255;
+    // quiet mode 2 activates the default max speed (0xFF)
+    ret = data->backend->qmod(data, 2);
+    if (ret != AE_OK) {
+      err_msg("set_max_speed",
+              "set max fan speed(s) failed (force reset)! errcode: %s",
+              acpi_format_exception(ret));
+      goto out;
+    }
+
+    // if reset was not forced, set max fan speed to 'state'
+  } else {
+    // is applied automatically on any available fan
+    // - docs say it should affect manual _AND_ automatic mode
+    ret = data->backend->set_max(data, state);
+    if (ret != AE_OK) {
+      err_msg("set_max_speed",
+              "set max fan speed(s) failed (no reset) errcode: %s",
+              acpi_format_exception(ret));
+
+      goto out;
+    }
+  }
+
+  // keep set max fan speed for the get_max
+  write_seqlock(&data->state_lock);
+  data->max_fan_speed_setting = state;
+  write_sequnlock(&data->state_lock);
+
+out:
+  mutex_unlock(&data->ec_lock);
+  return ret;
+}
+
+static int fan_set_auto(struct apple_fan_data *data) {
+  acpi_status ret;
+  int fan;
+
+  dbg_msg("fan-id: (all) | set to automatic mode");
+
+  mutex_lock(&data->ec_lock);
+
+  // setting (all) to auto-mode simultanously
+  // - the EC switches all fans, so keep them in sync (this also stops the
+  //   curve controller)
+  // - setpoints still queued by pwm stores are outdated by this
+  write_seqlock(&data->state_lock);
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    xchg(&data->pending_speed[fan], -1);
+    apple_fan_switch_mode(data, fan, APPLE_FAN_MODE_AUTO);
+    data->fan_states[fan] = -1;
+    data->fan_target[fan] = -1;
+    data->cooling[fan].active = false;
+  }
+  write_sequnlock(&data->state_lock);
+  __apple_fan_invalidate(data);
+
+  // call auto-mode for all fans!
+  ret = data->backend->set_auto(data);
+  mutex_unlock(&data->ec_lock);
+
+  apple_fan_notify(data);
+  if (ret != AE_OK) {
+    err_msg("set_auto",
+            "failed reseting fan(s) to auto-mode! "
+            "errcode: %s - DANGER! OVERHEAT? DANGER!",
+            acpi_format_exception(ret));
+
+    return ret;
+  }
+  return ret;
+}
+
+static acpi_status __temp_read(struct apple_fan_data *data,
+                               const struct apple_fan_temp_desc *desc,
+                               long *value) {
+  unsigned long long raw;
+  acpi_status ret;
+
+  dbg_msg("temp: %s | get (%s backend)", desc->label, data->backend->name);
+
+  ret = data->backend->read_temp(data, desc, &raw);
+  if (ret != AE_OK) {
+    // missing methods and open breakers are known (and logged) already
+    if (apple_fan_errno(ret) == -EIO)
+      err_msg("read_temp", "failed reading %s, errcode: %s", desc->label,
+              acpi_format_exception(ret));
+    return ret;
+  }
+
+  if (desc->decikelvin)
+    *value = ((long)raw - 2732) * 100;
+  else
+    *value = (long)raw * 1000;
+  return ret;
+}
+
+static int apple_fan_fans_init(struct apple_fan_data *data) {
+  unsigned long long count, rpm;
+  int fan;
+
+  mutex_lock(&data->ec_lock);
+  // apple_fan_init_work() paces the retries itself, every one of them has to
+  // reach the EC instead of being refused by the breaker of an earlier attempt
+  apple_fan_breaker_reset(data, APPLE_METHOD_SMC_FNUM);
+  apple_fan_breaker_reset(data, APPLE_METHOD_SMC_RPM);
+  if (data->backend->read_fan_count(data, &count) != AE_OK || !count) {
+    dbg_msg("fan count unknown, assuming %d", APPLE_FANS_DEFAULT);
+    count = APPLE_FANS_DEFAULT;
+  }
+  if (count > APPLE_MAX_FANS) {
+    warn_msg("init", "%llu fans reported, using the first %d", count,
+             APPLE_MAX_FANS);
+    count = APPLE_MAX_FANS;
+  }
+
+  // without a speed readout there is nothing to verify the count against
+  for (fan = 0; fan < count; fan++) {
+    if (!data->methods[APPLE_METHOD_SMC_RPM].present)
+      break;
+    if (data->backend->read_rpm(data, fan, &rpm) != AE_OK) {
+      warn_msg("init", "fan id: %d | no speed readout, ignoring it and above",
+               fan + 1);
+      count = fan;
+    }
+  }
+  data->nr_fans = count;
+  mutex_unlock(&data->ec_lock);
+
+  if (!data->nr_fans) {
+    dbg_msg("no fans found");
+    return -ENODEV;
+  }
+
+  info_msg("init", "found %d fan(s)", data->nr_fans);
+  return 0;
+}
+
+static void apple_fan_temp_init(struct apple_fan_data *data) {
+  const struct apple_fan_temp_desc *desc;
+  acpi_status ret;
+  long temp;
+  int i;
+
+  mutex_lock(&data->ec_lock);
+  for (i = 0; i < ARRAY_SIZE(apple_fan_temps); i++) {
+    desc = &apple_fan_temps[i];
+    if (data->nr_temps == APPLE_MAX_TEMPS)
+      break;
+
+    // temp1 keeps its place even if the readout fails right now
+    if (i) {
+      if (!data->methods[desc->method].present)
+        continue;
+
+      // some firmwares carry the method but report garbage
+      ret = __temp_read(data, desc, &temp);
+      if (ret != AE_OK || temp < TEMP_PROBE_MIN * 1000 ||
+          temp > TEMP_PROBE_MAX * 1000) {
+        info_msg("init", "ignoring temperature sensor %s", desc->label);
+        continue;
+      }
+    }
+
+    data->temp_desc[data->nr_temps++] = desc;
+  }
+  mutex_unlock(&data->ec_lock);
+
+  info_msg("init", "found %d temperature sensor(s)", data->nr_temps);
+}
+
+// -------------------BACKENDS----------------------------- //
+
+static const struct apple_fan_backend apple_fan_acpi_backend = {
+    .name = "acpi",
+    .init = apple_fan_resolve_methods,
+    .set_speed = apple_acpi_set_speed,
+    .set_auto = apple_acpi_set_auto,
+    .read_rpm = apple_acpi_read_rpm,
+    .read_fan_count = apple_acpi_read_fan_count,
+    .read_temp = apple_acpi_read_temp,
+    .set_max = apple_acpi_set_max,
+    .qmod = apple_acpi_qmod,
+};
+
+static const struct apple_fan_backend apple_fan_sim_backend = {
+    .name = "sim",
+    .init = apple_sim_init,
+    .set_speed = apple_sim_set_speed,
+    .set_auto = apple_sim_set_auto,
+    .read_rpm = apple_sim_read_rpm,
+    .read_fan_count = apple_sim_read_fan_count,
+    .read_temp = apple_sim_read_temp,
+    .set_max = apple_sim_set_max,
+    .qmod = apple_sim_qmod,
+};
+
+static const struct apple_fan_backend *
+apple_fan_find_backend(const char *name) {
+  if (sysfs_streq(name, apple_fan_acpi_backend.name))
+    return &apple_fan_acpi_backend;
+  if (sysfs_streq(name, apple_fan_sim_backend.name))
+    return &apple_fan_sim_backend;
+  return NULL;
+}
+
+static acpi_status apple_acpi_set_speed(struct apple_fan_data *data, int fan,
+                                        int speed) {
+  struct acpi_object_list params;
+  union acpi_object args[2];
+  unsigned long long value;
+
+  // set speed to 'speed' for given 'fan'-index
+  // -> automatically switch to manual mode!
+  params.count = ARRAY_SIZE(args);
+  params.pointer = args;
+  // Args:
+  // fan index
+  // - add '1' to index as '0' has a special meaning (auto-mode)
+  args[0].type = ACPI_TYPE_INTEGER;
+  args[0].integer.value = fan + 1;
+  // target fan speed
+  // - between 0x00 and MAX (0 - MAX)
+  //   - 'MAX' is usually 0xFF (255)
+  //   - should be getable with fan_get_max_speed()
+  args[1].type = ACPI_TYPE_INTEGER;
+  args[1].integer.value = speed;
+  // acpi call
+  return apple_fan_evaluate(data, APPLE_METHOD_SFNV, &params, &value);
+}
+
+static acpi_status apple_acpi_set_auto(struct apple_fan_data *data) {
+  struct acpi_object_list params;
+  union acpi_object args[2];
+  unsigned long long value;
+
+  params.count = ARRAY_SIZE(args);
+  params.pointer = args;
+  // special fan-id == 0 must be used
+  args[0].type = ACPI_TYPE_INTEGER;
+  args[0].integer.value = 0;
+  // speed has to be set to zero
+  args[1].type = ACPI_TYPE_INTEGER;
+  args[1].integer.value = 0;
+
+  // acpi call
+  return apple_fan_evaluate(data, APPLE_METHOD_SFNV, &params, &value);
+}
+
+static acpi_status apple_acpi_read_rpm(struct apple_fan_data *data, int fan,
+                                       unsigned long long *rpm) {
+  struct acpi_object_list params;
+  union acpi_object args[1];
+
+  // getting current fan 'speed' as 'state',
+  params.count = ARRAY_SIZE(args);
+  params.pointer = args;
+  // Args:
+  // - get speed from the fan with index 'fan'
+  args[0].type = ACPI_TYPE_INTEGER;
+  args[0].integer.value = fan;
+
+  // acpi call
+  return apple_fan_evaluate(data, APPLE_METHOD_SMC_RPM, &params, rpm);
+}
+
+static acpi_status apple_acpi_read_fan_count(struct apple_fan_data *data,
+                                             unsigned long long *count) {
+  return apple_fan_evaluate(data, APPLE_METHOD_SMC_FNUM, NULL, count);
+}
+
+static acpi_status apple_acpi_read_temp(struct apple_fan_data *data,
+                                        const struct apple_fan_temp_desc *desc,
+                                        unsigned long long *temp) {
+  return apple_fan_evaluate(data, desc->method, NULL, temp);
+}
+
+static acpi_status apple_acpi_set_max(struct apple_fan_data *data,
+                                      unsigned long state) {
+  struct acpi_object_list params;
+  union acpi_object args[1];
+  unsigned long long value;
+
+  // Args:
+  // - from 0x00 to 0xFF (0 - 255)
+  params.count = ARRAY_SIZE(args);
+  params.pointer = args;
+  args[0].type = ACPI_TYPE_INTEGER;
+  args[0].integer.value = state;
+
+  // acpi call
+  return apple_fan_evaluate(data, APPLE_METHOD_ST98, &params, &value);
+}
+
+static acpi_status apple_acpi_qmod(struct apple_fan_data *data, int mode) {
+  struct acpi_object_list params;
+  union acpi_object args[1];
+  unsigned long long value;
+
+  // use "SB.ARKD.QMOD" _without_ "SB.QFAN", which seems not writeable as
+  // expected
+  // Args:
+  // 0 - just returns
+  // 1 - sets quiet mode to QFAN value
+  // 2 - sets quiet mode to 0xFF (that's the default value)
   params.count = ARRAY_SIZE(args);
   params.pointer = args;
-  // special fan-id == 0 must be used
   args[0].type = ACPI_TYPE_INTEGER;
-  args[0].integer.value = 0;
-  // speed has to be set to zero
-  args[1].type = ACPI_TYPE_INTEGER;
-  args[1].integer.value = 0;
+  args[0].integer.value = mode;
 
   // acpi call
-  ret =
-      acpi_evaluate_integer(NULL, "\\_SB.PCI0.LPCB.EC0.SFNV", &params, &value);
-  if (ret != AE_OK) {
-    err_msg("set_auto",
-            "failed reseting fan(s) to auto-mode! "
-            "errcode: %s - DANGER! OVERHEAT? DANGER!",
-            acpi_format_exception(ret));
+  return apple_fan_evaluate(data, APPLE_METHOD_QMOD, &params, &value);
+}
 
-    return ret;
+static void apple_sim_init(struct apple_fan_data *data) {
+  struct apple_fan_sim *sim = &data->sim;
+  int i;
+
+  // every method "exists", calls are still traced and accounted
+  for (i = 0; i < APPLE_METHOD_COUNT; i++)
+    data->methods[i].present = true;
+
+  sim->last_ns = ktime_get_ns();
+  sim->temp = SIM_AMBIENT;
+  sim->nr_fans = clamp_t(unsigned int, sim_fans, 1, APPLE_MAX_FANS);
+  for (i = 0; i < sim->nr_fans; i++) {
+    sim->rpm[i] = SIM_RPM_MIN;
+    sim->speed[i] = -1;
+  }
+  sim->max_speed = 255;
+  sim->latency_us = -1;
+  sim->error_rate = -1;
+
+  info_msg("init", "using simulated EC, load: %u W, fans: %d", sim_load,
+           sim->nr_fans);
+}
+
+// speed (RPM) the simulated EC drives fan with index 'fan' towards
+static int apple_sim_target_rpm(struct apple_fan_sim *sim, int fan) {
+  int max_rpm = SIM_RPM_MAX * sim->max_speed / 255;
+  int rpm;
+
+  if (sim->speed[fan] >= 0) {
+    rpm = SIM_RPM_MAX * sim->speed[fan] / 255;
+    return min(rpm, max_rpm);
+  }
+
+  // auto-mode: minimum speed up to 50 C, full speed at 90 C
+  rpm = SIM_RPM_MIN + div_s64((sim->temp - 50000) *
+                                  (SIM_RPM_MAX - SIM_RPM_MIN),
+                              40000);
+  return clamp(rpm, SIM_RPM_MIN, max(max_rpm, SIM_RPM_MIN));
+}
+
+static void apple_sim_step(struct apple_fan_data *data) {
+  struct apple_fan_sim *sim = &data->sim;
+  u64 now = ktime_get_ns();
+  u64 elapsed = div_u64(now - sim->last_ns, NSEC_PER_MSEC);
+  s64 power, conductance;
+  int fan, step, target;
+
+  lockdep_assert_held(&data->ec_lock);
+
+  // keep the sub-ms remainder, otherwise frequent calls never advance
+  sim->last_ns += elapsed * NSEC_PER_MSEC;
+  if (elapsed > SIM_MAX_CATCHUP_MS) {
+    elapsed = SIM_MAX_CATCHUP_MS;
+    sim->last_ns = now;
+  }
+
+  for (; elapsed; elapsed -= step) {
+    step = min_t(u64, elapsed, SIM_STEP_MS);
+
+    // first-order lag towards the target speed (fan inertia)
+    conductance = SIM_CONDUCTANCE_MIN;
+    for (fan = 0; fan < sim->nr_fans; fan++) {
+      target = apple_sim_target_rpm(sim, fan);
+      sim->rpm[fan] +=
+          (target - sim->rpm[fan]) * step / (SIM_FAN_TAU_MS + step);
+      conductance += SIM_CONDUCTANCE_FAN / sim->nr_fans * sim->rpm[fan] /
+                     SIM_RPM_MAX;
+    }
+
+    // heat input minus what the airflow carries away (mW)
+    power = (s64)READ_ONCE(sim_load) * 1000 -
+            div_s64(conductance * (sim->temp - SIM_AMBIENT), 1000);
+    sim->temp += div_s64(power * step, 1000 * SIM_HEAT_CAPACITY);
   }
+}
+
+static acpi_status apple_sim_eval(struct apple_fan_data *data,
+                                  enum apple_fan_method method, u32 nargs,
+                                  u64 arg0, u64 arg1, u64 value) {
+  unsigned int error_rate = data->sim.error_rate >= 0
+                                ? data->sim.error_rate
+                                : READ_ONCE(sim_error_rate);
+  unsigned int latency = data->sim.latency_us >= 0 ? data->sim.latency_us
+                                                   : READ_ONCE(sim_latency_us);
+  const char *name = data->methods[method].name;
+  acpi_status ret = AE_OK;
+  u64 start, duration;
+
+  lockdep_assert_held(&data->ec_lock);
+
+  if (apple_fan_breaker_open(data, method))
+    return AE_APPLE_BREAKER_OPEN;
+
+  trace_apple_fan_acpi_eval_enter(name, nargs, arg0, arg1);
+
+  start = ktime_get_ns();
+  if (latency)
+    fsleep(latency);
+  if (error_rate && get_random_u32_below(1000) < error_rate)
+    ret = AE_ERROR;
+  duration = ktime_get_ns() - start;
+
+  trace_apple_fan_acpi_eval_exit(name, ret, ret == AE_OK ? value : 0,
+                                 duration);
+  apple_fan_account(data, method, ret, duration);
+  apple_fan_breaker_record(data, method, ret);
   return ret;
 }
 
-static ssize_t fan_label(struct device *dev, struct device_attribute *attr,
-                         char *buf) {
-  return sprintf(buf, "%s\n", apple_data.fan_desc);
+static acpi_status apple_sim_set_speed(struct apple_fan_data *data, int fan,
+                                       int speed) {
+  acpi_status ret;
+
+  apple_sim_step(data);
+  ret = apple_sim_eval(data, APPLE_METHOD_SFNV, 2, fan + 1, speed, 0);
+  if (ret == AE_OK)
+    data->sim.speed[fan] = speed;
+  return ret;
 }
 
-static ssize_t fan_label_gfx(struct device *dev, struct device_attribute *attr,
-                             char *buf) {
-  return sprintf(buf, "%s\n", apple_data.gfx_fan_desc);
+static acpi_status apple_sim_set_auto(struct apple_fan_data *data) {
+  acpi_status ret;
+  int fan;
+
+  apple_sim_step(data);
+  ret = apple_sim_eval(data, APPLE_METHOD_SFNV, 2, 0, 0, 0);
+  if (ret != AE_OK)
+    return ret;
+
+  for (fan = 0; fan < data->sim.nr_fans; fan++)
+    data->sim.speed[fan] = -1;
+  return ret;
+}
+
+static acpi_status apple_sim_read_rpm(struct apple_fan_data *data, int fan,
+                                      unsigned long long *rpm) {
+  acpi_status ret;
+
+  if (fan >= data->sim.nr_fans)
+    return AE_NOT_FOUND;
+
+  apple_sim_step(data);
+  ret = apple_sim_eval(data, APPLE_METHOD_SMC_RPM, 1, fan, 0,
+                       data->sim.rpm[fan]);
+  if (ret == AE_OK)
+    *rpm = data->sim.rpm[fan];
+  return ret;
 }
-static ssize_t fan_min(struct device *dev, struct device_attribute *attr,
-                       char *buf) {
-  return sprintf(buf, "%d\n", apple_data.fan_minimum);
+
+static acpi_status apple_sim_read_fan_count(struct apple_fan_data *data,
+                                            unsigned long long *count) {
+  acpi_status ret;
+
+  ret = apple_sim_eval(data, APPLE_METHOD_SMC_FNUM, 0, 0, 0,
+                       data->sim.nr_fans);
+  if (ret == AE_OK)
+    *count = data->sim.nr_fans;
+  return ret;
 }
 
-static ssize_t fan_min_gfx(struct device *dev, struct device_attribute *attr,
-                           char *buf) {
-  return sprintf(buf, "%d\n", apple_data.fan_minimum_gfx);
+static acpi_status apple_sim_read_temp(struct apple_fan_data *data,
+                                       const struct apple_fan_temp_desc *desc,
+                                       unsigned long long *temp) {
+  acpi_status ret;
+  s64 value;
+
+  apple_sim_step(data);
+  // every sensor follows the die temperature at a fixed offset, the EC keys
+  // report whole degrees, acpi thermal zones 0.1 kelvin
+  value = data->sim.temp + desc->sim_offset;
+  if (desc->decikelvin)
+    value = div_s64(value, 100) + 2732;
+  else
+    value = div_s64(value, 1000);
+  value = max_t(s64, value, 0);
+  ret = apple_sim_eval(data, desc->method, 0, 0, 0, value);
+  if (ret == AE_OK)
+    *temp = value;
+  return ret;
 }
 
-static ssize_t set_max_speed(struct device *dev, struct device_attribute *attr,
-                             const char *buf, size_t count) {
-  int state;
-  bool reset = false;
-  kstrtouint(buf, 10, &state);
-  if (state == 256) {
-    reset = true;
+static acpi_status apple_sim_set_max(struct apple_fan_data *data,
+                                     unsigned long state) {
+  acpi_status ret;
+
+  apple_sim_step(data);
+  ret = apple_sim_eval(data, APPLE_METHOD_ST98, 1, state, 0, 0);
+  if (ret == AE_OK)
+    data->sim.max_speed = state;
+  return ret;
+}
+
+static acpi_status apple_sim_qmod(struct apple_fan_data *data, int mode) {
+  acpi_status ret;
+
+  apple_sim_step(data);
+  ret = apple_sim_eval(data, APPLE_METHOD_QMOD, 1, mode, 0, 0);
+  if (ret == AE_OK && mode == 2)
+    data->sim.max_speed = 255;
+  return ret;
+}
+
+// -------------------THERMAL----------------------------- //
+
+static int apple_fan_cooling_get_max_state(struct thermal_cooling_device *cdev,
+                                           unsigned long *state) {
+  *state = APPLE_COOLING_STATES;
+  return 0;
+}
+
+static int apple_fan_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+                                           unsigned long *state) {
+  struct apple_fan_cooling *cooling = cdev->devdata;
+  struct apple_fan_data *data = cooling->data;
+  unsigned long pwm;
+  int err;
+
+  // the fan minimum raises the pwm of low states, so a state derived from
+  // the pwm would never match the one the governor asked for
+  mutex_lock(&data->ec_lock);
+  if (cooling->active) {
+    *state = cooling->state;
+    mutex_unlock(&data->ec_lock);
+    return 0;
   }
-  fan_set_max_speed(state, reset);
-  return count;
+  mutex_unlock(&data->ec_lock);
+
+  // user, curve or auto-mode
+  err = __fan_get_cur_state(data, cooling->fan, &pwm);
+  if (err)
+    return err;
+
+  *state = pwm * APPLE_COOLING_STATES / 255;
+  return 0;
 }
 
-static ssize_t get_max_speed(struct device *dev, struct device_attribute *attr,
-                             char *buf) {
-  unsigned long state = 0;
-  fan_get_max_speed(&state);
-  return sprintf(buf, "%lu\n", state);
+static int apple_fan_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+                                           unsigned long state) {
+  struct apple_fan_cooling *cooling = cdev->devdata;
+  struct apple_fan_data *data = cooling->data;
+  int fan = cooling->fan;
+  unsigned long pwm;
+  bool to_auto = false, applied = false;
+  int ret = AE_OK;
+
+  if (state > APPLE_COOLING_STATES)
+    return -EINVAL;
+
+  // 'active' only changes under 'ec_lock', together with the fan mode
+  mutex_lock(&data->ec_lock);
+  if (state == 0) {
+    // governor has nothing to cool, hand the fan back if it was ours
+    if (!cooling->active)
+      goto out;
+
+    // auto-mode switches all fans, keep the minimum if another one is
+    // controlled by the user
+    if (!apple_fan_others_claimed(data, BIT(fan))) {
+      cooling->active = false;
+      to_auto = true;
+      goto out;
+    }
+    // already held at the minimum
+    if (!cooling->state)
+      goto out;
+    pwm = data->fan_minimum[fan];
+  } else {
+    // don't fight a user-selected manual speed or fan curve
+    if (!cooling->active && data->fan_mode[fan] != APPLE_FAN_MODE_AUTO)
+      goto out;
+
+    pwm = DIV_ROUND_UP(state * 255, APPLE_COOLING_STATES);
+    pwm = max_t(unsigned long, pwm, data->fan_minimum[fan]);
+  }
+
+  dbg_msg("fan-id: %d | cooling state: %lu -> %lu", fan, state, pwm);
+  xchg(&data->pending_speed[fan], -1);
+  data->fan_target[fan] = -1;
+  // hands the fan back, so it is claimed again right after
+  ret = __fan_apply_state(data, fan, pwm);
+  cooling->active = ret == AE_OK;
+  cooling->state = state;
+  applied = true;
+out:
+  mutex_unlock(&data->ec_lock);
+
+  if (to_auto)
+    return fan_set_auto(data) == AE_OK ? 0 : -EIO;
+  if (applied)
+    apple_fan_notify(data);
+  return ret == AE_OK ? 0 : -EIO;
+}
+
+static const struct thermal_cooling_device_ops apple_fan_cooling_ops = {
+    .get_max_state = apple_fan_cooling_get_max_state,
+    .get_cur_state = apple_fan_cooling_get_cur_state,
+    .set_cur_state = apple_fan_cooling_set_cur_state,
+};
+
+static int apple_fan_tz_get_temp(struct thermal_zone_device *tz, int *temp) {
+  struct apple_fan_data *data = thermal_zone_device_priv(tz);
+
+  apple_fan_update_temp_if_stale(data, 0);
+  if (data->temp_status[0] != AE_OK)
+    return apple_fan_errno(data->temp_status[0]);
+
+  *temp = data->temp[0];
+  return 0;
+}
+
+static int apple_fan_tz_bind(struct thermal_zone_device *tz,
+                             struct thermal_cooling_device *cdev) {
+  struct apple_fan_data *data = thermal_zone_device_priv(tz);
+  int fan, trip, err;
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (data->cooling[fan].cdev == cdev)
+      break;
+  }
+  // not one of our fans
+  if (fan == data->nr_fans)
+    return 0;
+
+  for (trip = 0; trip < ARRAY_SIZE(apple_fan_trips); trip++) {
+    if (apple_fan_trips[trip].type == THERMAL_TRIP_HOT)
+      continue;
+
+    err = thermal_zone_bind_cooling_device(tz, trip, cdev, THERMAL_NO_LIMIT,
+                                           THERMAL_NO_LIMIT,
+                                           THERMAL_WEIGHT_DEFAULT);
+    if (err)
+      return err;
+  }
+  return 0;
+}
+
+static const struct thermal_zone_device_ops apple_fan_tz_ops = {
+    .get_temp = apple_fan_tz_get_temp,
+    .bind = apple_fan_tz_bind,
+};
+
+static int apple_fan_thermal_init(struct apple_fan_data *data) {
+  struct apple_fan_cooling *cooling;
+  int fan, err;
+
+  dbg_msg("init thermal devices");
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    cooling = &data->cooling[fan];
+    cooling->data = data;
+    cooling->fan = fan;
+    snprintf(cooling->name, sizeof(cooling->name), "%s%d", DRIVER_NAME, fan);
+
+    cooling->cdev = thermal_cooling_device_register(cooling->name, cooling,
+                                                    &apple_fan_cooling_ops);
+    if (IS_ERR(cooling->cdev)) {
+      err = PTR_ERR(cooling->cdev);
+      cooling->cdev = NULL;
+      goto fail;
+    }
+  }
+
+  // cooling devices must exist before the zone binds to them
+  data->tz = thermal_zone_device_register_with_trips(
+      DRIVER_NAME, apple_fan_trips, ARRAY_SIZE(apple_fan_trips), data,
+      &apple_fan_tz_ops, NULL, THERMAL_PASSIVE_DELAY, THERMAL_POLLING_DELAY);
+  if (IS_ERR(data->tz)) {
+    err = PTR_ERR(data->tz);
+    data->tz = NULL;
+    goto fail;
+  }
+
+  err = thermal_zone_device_enable(data->tz);
+  if (err)
+    goto fail;
+
+  return 0;
+
+fail:
+  err_msg("init", "could not register thermal devices, errcode: %d", err);
+  apple_fan_thermal_exit(data);
+  return err;
+}
+
+static void apple_fan_thermal_exit(struct apple_fan_data *data) {
+  int fan;
+
+  if (data->tz)
+    thermal_zone_device_unregister(data->tz);
+  data->tz = NULL;
+
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (data->cooling[fan].cdev)
+      thermal_cooling_device_unregister(data->cooling[fan].cdev);
+    data->cooling[fan].cdev = NULL;
+  }
+}
+
+static int apple_fan_profile_get(struct platform_profile_handler *pprof,
+                                 enum platform_profile_option *profile) {
+  struct apple_fan_data *data =
+      container_of(pprof, struct apple_fan_data, profile_handler);
+
+  mutex_lock(&data->curve_lock);
+  *profile = data->profile;
+  mutex_unlock(&data->curve_lock);
+  return 0;
 }
 
-static ssize_t temp1_input(struct device *dev, struct device_attribute *attr,
-                           char *buf) {
+static int apple_fan_profile_set(struct platform_profile_handler *pprof,
+                                 enum platform_profile_option profile) {
+  struct apple_fan_data *data =
+      container_of(pprof, struct apple_fan_data, profile_handler);
+  const struct apple_fan_profile *preset;
+  struct apple_fan_curve *curves[APPLE_MAX_FANS] = {NULL};
+  bool apply[APPLE_MAX_FANS] = {false};
   acpi_status ret;
-  unsigned long long int value;
-  ssize_t size = 0;
+  int fan, sensor, target;
+
+  if (profile >= ARRAY_SIZE(apple_fan_profiles) ||
+      !apple_fan_profiles[profile].max_speed)
+    return -EOPNOTSUPP;
+  preset = &apple_fan_profiles[profile];
+
+  dbg_msg("fan-id: (all) | set profile: %d", profile);
+
+  mutex_lock(&data->curve_lock);
+
+  // the curves keep their ramp, source sensor and feed-forward gain
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    curves[fan] = apple_fan_curve_dup(data, fan);
+    if (!curves[fan])
+      goto nomem;
+    curves[fan]->npoints = preset->curve.npoints;
+    memcpy(curves[fan]->points, preset->curve.points,
+           sizeof(preset->curve.points));
+    curves[fan]->hysteresis = preset->curve.hysteresis;
+  }
 
-  dbg_msg("temp-id: 1 | get (acpi eval)");
+  mutex_lock(&data->ec_lock);
 
-  // acpi call
-  ret = acpi_evaluate_integer(NULL, "\\_SB.PCI0.LPCB.EC0.TH1R", NULL, &value);
+  // the only write that fails the switch, nothing has changed until here
+  if (preset->max_speed == 255)
+    ret = data->backend->qmod(data, 2);
+  else
+    ret = data->backend->set_max(data, preset->max_speed);
   if (ret != AE_OK) {
-    err_msg("read_temp", "failed reading temperature, errcode: %s",
+    err_msg("profile", "set max fan speed(s) failed! errcode: %s",
             acpi_format_exception(ret));
-    return ret;
+    mutex_unlock(&data->ec_lock);
+    for (fan = 0; fan < data->nr_fans; fan++)
+      kfree(curves[fan]);
+    goto out;
+  }
+
+  write_seqlock(&data->state_lock);
+  data->max_fan_speed_setting = preset->max_speed;
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    data->fan_minimum[fan] = preset->minimum;
+    apple_fan_curve_publish(data, fan, curves[fan]);
+
+    // the calibration sweep owns the fan until it is done or aborted, a
+    // profile restored at boot must not take fans away from the firmware or
+    // override a manual speed
+    if (apple_fan_sweeping(data, fan) ||
+        data->fan_mode[fan] != APPLE_FAN_MODE_CURVE)
+      continue;
+
+    xchg(&data->pending_speed[fan], -1);
+    data->cooling[fan].active = false;
+    data->load.offset[fan] = 0;
+    // without a temperature the controller falls back to auto-mode
+    data->fan_states[fan] = -1;
+    data->fan_target[fan] = -1;
+    sensor = curves[fan]->sensor;
+    if (data->temp_status[sensor] == AE_OK) {
+      target = apple_fan_curve_eval(curves[fan],
+                                    data->temp_filtered[sensor] / 1000);
+      data->fan_states[fan] = clamp(target, preset->minimum, 255);
+      apply[fan] = true;
+    }
   }
-  size = sprintf((char *)&buf, "%llu\n", value);
-  return size;
+  write_sequnlock(&data->state_lock);
+  __apple_fan_invalidate(data);
+
+  // the curve speeds at the current temperature, the controller takes over
+  for (fan = 0; fan < data->nr_fans; fan++) {
+    if (apply[fan] &&
+        fan_set_speed(data, fan, data->fan_states[fan]) != AE_OK)
+      warn_msg("profile", "fan-id: %d | could not apply the curve speed",
+               fan);
+  }
+  data->profile = profile;
+  mutex_unlock(&data->ec_lock);
+
+out:
+  mutex_unlock(&data->curve_lock);
+
+  if (ret != AE_OK)
+    return -EIO;
+
+  mod_delayed_work(system_wq, &data->controller,
+                   msecs_to_jiffies(curve_interval));
+  apple_fan_notify(data);
+  return 0;
+
+nomem:
+  mutex_unlock(&data->curve_lock);
+  for (fan = 0; fan < data->nr_fans; fan++)
+    kfree(curves[fan]);
+  return -ENOMEM;
 }
 
-static ssize_t temp1_label(struct device *dev, struct device_attribute *attr,
-                           char *buf) {
-  return sprintf(buf, "%s\n", TEMP1_LABEL);
+static void apple_fan_profile_init(struct apple_fan_data *data) {
+  int err;
+
+  data->profile_handler.profile_get = apple_fan_profile_get;
+  data->profile_handler.profile_set = apple_fan_profile_set;
+  set_bit(PLATFORM_PROFILE_LOW_POWER, data->profile_handler.choices);
+  set_bit(PLATFORM_PROFILE_BALANCED, data->profile_handler.choices);
+  set_bit(PLATFORM_PROFILE_PERFORMANCE, data->profile_handler.choices);
+
+  err = platform_profile_register(&data->profile_handler);
+  if (err) {
+    // e.g. another platform driver already provides the profiles
+    warn_msg("init", "could not register platform_profile, errcode: %d", err);
+    return;
+  }
+  data->profile_registered = true;
 }
 
-static ssize_t temp1_crit(struct device *dev, struct device_attribute *attr,
-                          char *buf) {
-  return sprintf(buf, "%d\n", TEMP1_CRIT);
+static void apple_fan_profile_exit(struct apple_fan_data *data) {
+  if (data->profile_registered)
+    platform_profile_remove();
+  data->profile_registered = false;
 }
 
 // -------------------HWMON----------------------------- //
 
-// Makros defining all possible hwmon attributes
-static DEVICE_ATTR(pwm1, S_IWUSR | S_IRUGO, fan_get_cur_state,
-                   fan_set_cur_state);
-static DEVICE_ATTR(pwm1_enable, S_IWUSR | S_IRUGO, fan_get_cur_control_state,
-                   fan_set_cur_control_state);
-
-static DEVICE_ATTR(fan1_mode, S_IWUSR | S_IRUGO, fan1_get_mode, fan1_set_mode);
-static DEVICE_ATTR(fan1_speed, S_IWUSR | S_IRUGO, fan_get_cur_state,
-                   fan_set_cur_state);
-
-static DEVICE_ATTR(fan1_min, S_IRUGO, fan_min, NULL);
-static DEVICE_ATTR(fan1_input, S_IRUGO, fan_rpm, NULL);
-static DEVICE_ATTR(fan1_label, S_IRUGO, fan_label, NULL);
-
-static DEVICE_ATTR(fan1_max, S_IWUSR | S_IRUGO, get_max_speed, set_max_speed);
-
-// @TODO: remove??? they are obsolete...
-static DEVICE_ATTR(pwm2, S_IWUSR | S_IRUGO, fan_get_cur_state_gfx,
-                   fan_set_cur_state_gfx);
-static DEVICE_ATTR(pwm2_enable, S_IWUSR | S_IRUGO,
-                   fan_get_cur_control_state_gfx,
-                   fan_set_cur_control_state_gfx);
-
-static DEVICE_ATTR(fan2_mode, S_IWUSR | S_IRUGO, fan2_get_mode, fan2_set_mode);
-static DEVICE_ATTR(fan2_speed, S_IWUSR | S_IRUGO, fan_get_cur_state_gfx,
-                   fan_set_cur_state_gfx);
-
-static DEVICE_ATTR(fan2_min, S_IRUGO, fan_min_gfx, NULL);
-static DEVICE_ATTR(fan2_max, S_IWUSR | S_IRUGO, get_max_speed, set_max_speed);
-static DEVICE_ATTR(fan2_input, S_IRUGO, fan_rpm_gfx, NULL);
-static DEVICE_ATTR(fan2_label, S_IRUGO, fan_label_gfx, NULL);
-
-static DEVICE_ATTR(temp1_input, S_IRUGO, temp1_input, NULL);
-static DEVICE_ATTR(temp1_label, S_IRUGO, temp1_label, NULL);
-static DEVICE_ATTR(temp1_crit, S_IRUGO, temp1_crit, NULL);
-
-static struct attribute *hwmon_attrs[] = {NULL, NULL, NULL, NULL, NULL, NULL,
-                                          NULL, NULL, NULL, NULL, NULL, NULL,
-                                          NULL, NULL, NULL, NULL, NULL, NULL,
-
-                                          NULL};
-// by now sysfs is always visible
-static umode_t apple_hwmon_sysfs_is_visible(struct kobject *kobj,
-                                            struct attribute *attr, int idx) {
+static long apple_fan_mode_to_pwm_enable(enum apple_fan_mode mode) {
+  switch (mode) {
+  case APPLE_FAN_MODE_MANUAL:
+    return APPLE_PWM_ENABLE_MANUAL;
+  case APPLE_FAN_MODE_CURVE:
+    return APPLE_PWM_ENABLE_CURVE;
+  default:
+    return APPLE_PWM_ENABLE_FIRMWARE;
+  }
+}
+
+static int apple_fan_pwm_enable_to_mode(long val, enum apple_fan_mode *mode) {
+  switch (val) {
+  case APPLE_PWM_ENABLE_MANUAL:
+    *mode = APPLE_FAN_MODE_MANUAL;
+    return 0;
+  case APPLE_PWM_ENABLE_FIRMWARE:
+    *mode = APPLE_FAN_MODE_AUTO;
+    return 0;
+  case APPLE_PWM_ENABLE_CURVE:
+    *mode = APPLE_FAN_MODE_CURVE;
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+static umode_t apple_hwmon_is_visible(const void *drvdata,
+                                      enum hwmon_sensor_types type, u32 attr,
+                                      int channel) {
+  const struct apple_fan_data *data = drvdata;
+
+  switch (type) {
+  case hwmon_chip:
+    if (attr == hwmon_chip_update_interval)
+      return S_IWUSR | S_IRUGO;
+    break;
+  case hwmon_fan:
+    // channels of fans not found during probe are hidden
+    if (channel >= data->nr_fans)
+      break;
+    if (attr == hwmon_fan_max)
+      return S_IWUSR | S_IRUGO;
+    return S_IRUGO;
+  case hwmon_pwm:
+    if (channel >= data->nr_fans)
+      break;
+    return S_IWUSR | S_IRUGO;
+  case hwmon_temp:
+    // channels of sensors not found during probe are hidden
+    if (channel >= data->nr_temps)
+      break;
+    if (attr == hwmon_temp_max)
+      return S_IWUSR | S_IRUGO;
+    return S_IRUGO;
+  default:
+    break;
+  }
+  return 0;
+}
+
+static int apple_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+                            u32 attr, int channel, long *val) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  unsigned long state;
+  int mode;
+
+  switch (type) {
+  case hwmon_chip:
+    if (attr != hwmon_chip_update_interval)
+      break;
+    *val = data->update_interval;
+    return 0;
+
+  case hwmon_fan:
+    switch (attr) {
+    case hwmon_fan_input:
+      apple_fan_update_fan_if_stale(data, channel);
+      // -ENODATA without a method or with an open breaker, -EIO on EC errors
+      if (data->fan_rpm_status[channel] != AE_OK)
+        return apple_fan_errno(data->fan_rpm_status[channel]);
+      *val = data->fan_rpm[channel];
+      return 0;
+    case hwmon_fan_min:
+      *val = data->fan_minimum[channel];
+      return 0;
+    case hwmon_fan_max:
+      fan_get_max_speed(data, &state);
+      *val = state;
+      return 0;
+    case hwmon_fan_alarm:
+      apple_fan_update_fan_if_stale(data, channel);
+      *val = data->fan_alarm[channel];
+      return 0;
+    }
+    break;
+
+  case hwmon_pwm:
+    switch (attr) {
+    case hwmon_pwm_input:
+      __fan_get_cur_state(data, channel, &state);
+      *val = state;
+      return 0;
+    case hwmon_pwm_enable:
+      __fan_get_cur_control_state(data, channel, &mode);
+      *val = apple_fan_mode_to_pwm_enable(mode);
+      return 0;
+    }
+    break;
+
+  case hwmon_temp:
+    switch (attr) {
+    case hwmon_temp_input:
+      apple_fan_update_temp_if_stale(data, channel);
+      if (data->temp_status[channel] != AE_OK)
+        return apple_fan_errno(data->temp_status[channel]);
+      *val = data->temp[channel];
+      return 0;
+    case hwmon_temp_max:
+      *val = data->temp1_max;
+      return 0;
+    case hwmon_temp_crit:
+      // hwmon reports millidegree celsius
+      *val = data->temp_desc[channel]->crit * 1000;
+      return 0;
+    case hwmon_temp_max_alarm:
+      apple_fan_update_temp_if_stale(data, 0);
+      *val = data->temp1_max_alarm;
+      return 0;
+    case hwmon_temp_crit_alarm:
+      apple_fan_update_temp_if_stale(data, 0);
+      *val = data->temp1_crit_alarm;
+      return 0;
+    }
+    break;
+
+  default:
+    break;
+  }
+  return -EOPNOTSUPP;
+}
+
+static int apple_hwmon_read_string(struct device *dev,
+                                   enum hwmon_sensor_types type, u32 attr,
+                                   int channel, const char **str) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+
+  if (type == hwmon_fan && attr == hwmon_fan_label) {
+    *str = data->fan_desc[channel];
+    return 0;
+  }
+  if (type == hwmon_temp && attr == hwmon_temp_label) {
+    *str = data->temp_desc[channel]->label;
+    return 0;
+  }
+  return -EOPNOTSUPP;
+}
+
+static int apple_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+                             u32 attr, int channel, long val) {
+  struct apple_fan_data *data = dev_get_drvdata(dev);
+  enum apple_fan_mode mode;
+
+  switch (type) {
+  case hwmon_chip:
+    if (attr != hwmon_chip_update_interval)
+      break;
+    if (val < 0)
+      return -EINVAL;
+    // 0 stops the sampler, reads refresh on demand from now on
+    if (!val) {
+      WRITE_ONCE(data->update_interval, 0);
+      cancel_delayed_work_sync(&data->sampler);
+      return 0;
+    }
+    WRITE_ONCE(data->update_interval,
+               clamp_val(val, UPDATE_INTERVAL_MIN, UPDATE_INTERVAL_MAX));
+    // apply the new period right away
+    mod_delayed_work(system_wq, &data->sampler,
+                     msecs_to_jiffies(data->update_interval));
+    return 0;
+
+  case hwmon_fan:
+    if (attr != hwmon_fan_max)
+      break;
+    // 256 forces a reset to the default max speed
+    if (val < 0 || val > 256)
+      return -EINVAL;
+    if (fan_set_max_speed(data, val, val == 256) != AE_OK)
+      return -EIO;
+    return 0;
+
+  case hwmon_pwm:
+    // the calibration sweep owns the fan until it is done or aborted
+    if (apple_fan_sweeping(data, channel))
+      return -EBUSY;
+    switch (attr) {
+    case hwmon_pwm_input:
+      if (val < 0 || val > 255)
+        return -EINVAL;
+      apple_fan_queue_speed(data, channel, val);
+      return 0;
+    case hwmon_pwm_enable:
+      if (apple_fan_pwm_enable_to_mode(val, &mode))
+        return -EINVAL;
+      if (mode == APPLE_FAN_MODE_AUTO)
+        return apple_fan_user_set_auto(data);
+      if (__fan_set_cur_control_state(data, channel, mode) != AE_OK)
+        return -EIO;
+      return 0;
+    }
+    break;
+
+  case hwmon_temp:
+    if (attr != hwmon_temp_max)
+      break;
+    // re-evaluate against the cached temperature, no need to wait for the
+    // next refresh
+    mutex_lock(&data->update_lock);
+    data->temp1_max = clamp_val(val, 0, TEMP1_CRIT * 1000);
+    if (data->valid)
+      __apple_fan_check_alarms(data);
+    mutex_unlock(&data->update_lock);
+
+    apple_fan_notify(data);
+    return 0;
+
+  default:
+    break;
+  }
+  return -EOPNOTSUPP;
+}
+
+static const struct hwmon_channel_info *const apple_hwmon_info[] = {
+    HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+    // one channel per APPLE_MAX_FANS, unused ones are hidden
+    HWMON_CHANNEL_INFO(fan,
+                       HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN |
+                           HWMON_F_MAX | HWMON_F_ALARM,
+                       HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN |
+                           HWMON_F_MAX | HWMON_F_ALARM,
+                       HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN |
+                           HWMON_F_MAX | HWMON_F_ALARM,
+                       HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN |
+                           HWMON_F_MAX | HWMON_F_ALARM),
+    HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+                       HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+                       HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+                       HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+    // temp1 (TH1R) carries the alarms, one channel per APPLE_MAX_TEMPS
+    HWMON_CHANNEL_INFO(temp,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX |
+                           HWMON_T_CRIT | HWMON_T_MAX_ALARM |
+                           HWMON_T_CRIT_ALARM,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT,
+                       HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_CRIT),
+    NULL};
+
+static const struct hwmon_ops apple_hwmon_ops = {
+    .is_visible = apple_hwmon_is_visible,
+    .read = apple_hwmon_read,
+    .read_string = apple_hwmon_read_string,
+    .write = apple_hwmon_write,
+};
+
+static const struct hwmon_chip_info apple_hwmon_chip_info = {
+    .ops = &apple_hwmon_ops,
+    .info = apple_hwmon_info,
+};
+
+// non-standard attributes, the index selects the fan channel
+// non-standard attributes of fan with index 'idx', named fan<n>_*
+#define APPLE_FAN_ATTRS(n, idx)                                                \
+  static SENSOR_DEVICE_ATTR(fan##n##_mode, S_IWUSR | S_IRUGO, fan_get_mode,    \
+                            fan_set_mode, idx);                                \
+  static SENSOR_DEVICE_ATTR(fan##n##_speed, S_IWUSR | S_IRUGO, fan_get_speed,  \
+                            fan_set_speed_attr, idx);                          \
+  static SENSOR_DEVICE_ATTR(fan##n##_curve, S_IWUSR | S_IRUGO, fan_get_curve,  \
+                            fan_set_curve, idx);                               \
+  static SENSOR_DEVICE_ATTR(fan##n##_curve_hyst, S_IWUSR | S_IRUGO,            \
+                            fan_get_curve_hyst, fan_set_curve_hyst, idx);      \
+  static SENSOR_DEVICE_ATTR(fan##n##_ff_gain, S_IWUSR | S_IRUGO,               \
+                            fan_get_ff_gain, fan_set_ff_gain, idx);            \
+  static SENSOR_DEVICE_ATTR(fan##n##_slew, S_IWUSR | S_IRUGO, fan_get_slew,    \
+                            fan_set_slew, idx);                                \
+  static SENSOR_DEVICE_ATTR(fan##n##_deadband, S_IWUSR | S_IRUGO,              \
+                            fan_get_deadband, fan_set_deadband, idx);          \
+  static SENSOR_DEVICE_ATTR(fan##n##_calibration, S_IWUSR | S_IRUGO,           \
+                            fan_get_calib, fan_set_calib, idx);                \
+  static SENSOR_DEVICE_ATTR(fan##n##_calibrate, S_IWUSR | S_IRUGO,             \
+                            fan_get_sweep, fan_set_sweep, idx)
+
+#define APPLE_FAN_ATTR_LIST(n)                                                 \
+  &sensor_dev_attr_fan##n##_mode.dev_attr.attr,                                \
+      &sensor_dev_attr_fan##n##_speed.dev_attr.attr,                           \
+      &sensor_dev_attr_fan##n##_curve.dev_attr.attr,                           \
+      &sensor_dev_attr_fan##n##_curve_hyst.dev_attr.attr,                      \
+      &sensor_dev_attr_fan##n##_ff_gain.dev_attr.attr,                         \
+      &sensor_dev_attr_fan##n##_slew.dev_attr.attr,                            \
+      &sensor_dev_attr_fan##n##_deadband.dev_attr.attr,                        \
+      &sensor_dev_attr_fan##n##_calibration.dev_attr.attr,                     \
+      &sensor_dev_attr_fan##n##_calibrate.dev_attr.attr
+
+APPLE_FAN_ATTRS(1, 0);
+APPLE_FAN_ATTRS(2, 1);
+APPLE_FAN_ATTRS(3, 2);
+APPLE_FAN_ATTRS(4, 3);
+// device-wide attributes, index 0 is always a present fan
+static SENSOR_DEVICE_ATTR(fan_sync, S_IWUSR, NULL, fan_set_sync, 0);
+static SENSOR_DEVICE_ATTR(fan_ff_threshold, S_IWUSR | S_IRUGO,
+                          fan_get_ff_threshold, fan_set_ff_threshold, 0);
+static SENSOR_DEVICE_ATTR(fan_ff_lead, S_IWUSR | S_IRUGO, fan_get_ff_lead,
+                          fan_set_ff_lead, 0);
+static SENSOR_DEVICE_ATTR(fan_ff_load, S_IRUGO, fan_get_ff_load, NULL, 0);
+static SENSOR_DEVICE_ATTR(fan_temp_ema, S_IWUSR | S_IRUGO, fan_get_temp_ema,
+                          fan_set_temp_ema, 0);
+
+static struct attribute *hwmon_attrs[] = {
+    APPLE_FAN_ATTR_LIST(1),
+    APPLE_FAN_ATTR_LIST(2),
+    APPLE_FAN_ATTR_LIST(3),
+    APPLE_FAN_ATTR_LIST(4),
+    &sensor_dev_attr_fan_sync.dev_attr.attr,
+    &sensor_dev_attr_fan_ff_threshold.dev_attr.attr,
+    &sensor_dev_attr_fan_ff_lead.dev_attr.attr,
+    &sensor_dev_attr_fan_ff_load.dev_attr.attr,
+    &sensor_dev_attr_fan_temp_ema.dev_attr.attr,
+    NULL};
+
+// hides the attributes of fans not found during probe
+static umode_t apple_fan_attr_is_visible(struct kobject *kobj,
+                                         struct attribute *attr, int n) {
+  struct apple_fan_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+  struct device_attribute *dattr =
+      container_of(attr, struct device_attribute, attr);
+
+  if (to_sensor_dev_attr(dattr)->index >= data->nr_fans)
+    return 0;
   return attr->mode;
 }
 
+// fanX_curve_table, 'private' holds the fan index
+#define APPLE_FAN_CURVE_TABLE(n, idx)                                          \
+  static struct bin_attribute bin_attr_fan##n##_curve_table = {                \
+      .attr = {.name = "fan" #n "_curve_table", .mode = S_IWUSR | S_IRUGO},  \
+      .size = sizeof(struct apple_fan_curve_table),                            \
+      .read = fan_read_curve_table,                                            \
+      .write = fan_write_curve_table,                                          \
+      .private = (void *)idx}
+
+APPLE_FAN_CURVE_TABLE(1, 0);
+APPLE_FAN_CURVE_TABLE(2, 1);
+APPLE_FAN_CURVE_TABLE(3, 2);
+APPLE_FAN_CURVE_TABLE(4, 3);
+
+static struct bin_attribute *hwmon_bin_attrs[] = {
+    &bin_attr_fan1_curve_table, &bin_attr_fan2_curve_table,
+    &bin_attr_fan3_curve_table, &bin_attr_fan4_curve_table, NULL};
+
+static umode_t apple_fan_bin_attr_is_visible(struct kobject *kobj,
+                                             struct bin_attribute *attr,
+                                             int n) {
+  struct apple_fan_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+
+  if ((long)attr->private >= data->nr_fans)
+    return 0;
+  return attr->attr.mode;
+}
+
 static struct attribute_group hwmon_attr_group = {
-    .is_visible = apple_hwmon_sysfs_is_visible, .attrs = hwmon_attrs};
-// will create hwmon_attr_groups (?)
+    .attrs = hwmon_attrs,
+    .bin_attrs = hwmon_bin_attrs,
+    .is_visible = apple_fan_attr_is_visible,
+    .is_bin_visible = apple_fan_bin_attr_is_visible,
+};
+// will create hwmon_attr_groups (passed as extra groups)
 __ATTRIBUTE_GROUPS(hwmon_attr);
 
 static int apple_fan_hwmon_init(struct apple_fan *apple) {
+  struct device *hwmon_dev;
 
   dbg_msg("init hwmon device");
 
-  apple->hwmon_dev = hwmon_device_register_with_groups(
-      &apple->platform_device->dev, "apple_fan", apple, hwmon_attr_groups);
+  hwmon_dev = hwmon_device_register_with_info(
+      &apple->platform_device->dev, "apple_fan", apple->data,
+      &apple_hwmon_chip_info, hwmon_attr_groups);
 
-  if (IS_ERR(apple->hwmon_dev)) {
+  if (IS_ERR(hwmon_dev)) {
     err_msg("init", "could not register apple hwmon device");
-    return PTR_ERR(apple->hwmon_dev);
+    return PTR_ERR(hwmon_dev);
   }
 
+  // the sampler may already be delivering events (see apple_fan_notify())
+  mutex_lock(&apple->data->update_lock);
+  apple->hwmon_dev = hwmon_dev;
+  mutex_unlock(&apple->data->update_lock);
   return 0;
 }
 
@@ -755,7 +4986,8 @@ static int apple_fan_probe(struct platform_device *pdev) {
   struct apple_fan_driver *wdrv = to_apple_fan_driver(pdrv);
 
   struct apple_fan *apple;
-  int err = 0;
+  struct apple_fan_data *data;
+  int i;
 
   dbg_msg("probe for device");
 
@@ -763,38 +4995,193 @@ static int apple_fan_probe(struct platform_device *pdev) {
   if (!apple)
     return -ENOMEM;
 
+  data = kmemdup(&apple_data_defaults, sizeof(*data), GFP_KERNEL);
+  if (!data) {
+    kfree(apple);
+    return -ENOMEM;
+  }
+
+  if (update_interval)
+    data->update_interval =
+        clamp_val(update_interval, UPDATE_INTERVAL_MIN, UPDATE_INTERVAL_MAX);
+  else
+    data->update_interval = 0;
+
+  data->backend = apple_fan_find_backend(backend);
+  if (!data->backend) {
+    err_msg("probe", "unknown backend '%s', use 'acpi' or 'sim'", backend);
+    kfree(data);
+    kfree(apple);
+    return -EINVAL;
+  }
+
+  data->stats = alloc_percpu(struct apple_fan_stats);
+  if (!data->stats) {
+    kfree(data);
+    kfree(apple);
+    return -ENOMEM;
+  }
+
+  data->wq = alloc_ordered_workqueue(DRIVER_NAME, 0);
+  if (!data->wq) {
+    free_percpu(data->stats);
+    kfree(data);
+    kfree(apple);
+    return -ENOMEM;
+  }
+
   apple->driver = wdrv;
   apple->hwmon_dev = NULL;
   apple->platform_device = pdev;
+  apple->data = data;
 
-  // set apple-dev as member into global data struct
-  apple_data.apple_fan_obj = apple;
+  // link the per-device state back to its device
+  data->apple_fan_obj = apple;
+
+  mutex_init(&data->ec_lock);
+  seqlock_init(&data->state_lock);
+  mutex_init(&data->update_lock);
+  INIT_DELAYED_WORK(&data->sampler, apple_fan_sampler_work);
+
+  // pwm stores are applied in order, one EC round-trip per fan at a time
+  for (i = 0; i < APPLE_MAX_FANS; i++) {
+    data->speed[i].data = data;
+    data->speed[i].fan = i;
+    INIT_DELAYED_WORK(&data->speed[i].work, apple_fan_speed_work);
+  }
+
+  // curve controller only runs once a fan is switched to curve mode
+  mutex_init(&data->curve_lock);
+  INIT_DELAYED_WORK(&data->controller, apple_fan_controller_work);
+
+  // calibration sweeps are started through fanX_calibrate
+  mutex_init(&data->sweep_lock);
+  for (i = 0; i < APPLE_MAX_FANS; i++) {
+    data->sweep[i].data = data;
+    data->sweep[i].fan = i;
+    INIT_DELAYED_WORK(&data->sweep[i].work, apple_fan_sweep_work);
+  }
 
   wdrv->platform_device = pdev;
   platform_set_drvdata(apple->platform_device, apple);
 
+  // talking to the EC is left to apple_fan_init_work(), a slow EC must not
+  // hold up the boot
+  INIT_WORK(&data->init_work, apple_fan_init_work);
+  queue_work(data->wq, &data->init_work);
+  return 0;
+}
+
+static void apple_fan_init_work(struct work_struct *work) {
+  struct apple_fan_data *data =
+      container_of(work, struct apple_fan_data, init_work);
+  struct apple_fan *apple = data->apple_fan_obj;
+  int err, retry;
+
+  // e.g. look up all acpi methods once, callers use the cached handles
+  data->backend->init(data);
+
+  // everything per fan is sized by this
+  // - a single failed read (e.g. an EC still busy after boot) must not leave
+  //   the driver loaded but without any device
+  for (retry = 0; apple_fan_fans_init(data); retry++) {
+    if (retry == FANS_INIT_RETRIES) {
+      err_msg("init", "no fans found after %d retries, giving up - the fans "
+                      "stay under firmware control",
+              FANS_INIT_RETRIES);
+      return;
+    }
+    msleep(FANS_INIT_RETRY_MS << retry);
+  }
+
+  // state <-> rpm conversion tables of this model
+  apple_fan_calib_init(data);
+
+  if (apple_fan_curves_init(data))
+    return;
+
+  // temp1..tempN, fixed from here on
+  apple_fan_temp_init(data);
+
+  // start sampling sensors, readers are served from the cache
+  if (data->update_interval)
+    schedule_delayed_work(&data->sampler, 0);
+
   sysfs_create_group(&apple->platform_device->dev.kobj,
                      &platform_attribute_group);
 
   err = apple_fan_hwmon_init(apple);
-  if (err)
-    goto fail_hwmon;
+  if (err) {
+    cancel_delayed_work_sync(&data->sampler);
+    apple_fan_sysfs_exit(apple->platform_device);
+    return;
+  }
 
-  return 0;
+  apple_fan_debugfs_init(data);
 
-fail_hwmon:
-  apple_fan_sysfs_exit(apple->platform_device);
-  kfree(apple);
-  return err;
+  // history is optional, the driver works without it
+  if (apple_fan_ring_init(data))
+    warn_msg("init", "could not create the telemetry ring");
+
+  // the fans are still usable through hwmon if this fails
+  if (thermal)
+    apple_fan_thermal_init(data);
+
+  // quiet/balanced/performance presets through the standard interface
+  apple_fan_profile_init(data);
+
+  data->ready = true;
+  info_msg("init", "created hwmon device: %s", dev_name(apple->hwmon_dev));
+  info_msg("init", "finished init, found %d fan(s) to control",
+           data->nr_fans);
 }
 
 static int apple_fan_remove(struct platform_device *device) {
   struct apple_fan *apple;
+  struct device *hwmon_dev;
+  int fan;
 
   dbg_msg("remove apple_fan");
 
   apple = platform_get_drvdata(device);
+
+  // nothing was published if the deferred init is cut short or failed
+  cancel_work_sync(&apple->data->init_work);
+  if (!apple->data->ready) {
+    destroy_workqueue(apple->data->wq);
+    goto out;
+  }
+
+  apple_fan_profile_exit(apple->data);
+  apple_fan_thermal_exit(apple->data);
+  apple_fan_ring_exit(apple->data);
+  debugfs_remove_recursive(apple->data->debugfs);
+
+  // stop event delivery before the hwmon device goes away
+  mutex_lock(&apple->data->update_lock);
+  hwmon_dev = apple->hwmon_dev;
+  apple->hwmon_dev = NULL;
+  mutex_unlock(&apple->data->update_lock);
+  hwmon_device_unregister(hwmon_dev);
+  cancel_delayed_work_sync(&apple->data->sampler);
+  // a finishing sweep restores curve mode and re-arms the controller, so the
+  // sweeps must be gone before the controller is cancelled
+  for (fan = 0; fan < apple->data->nr_fans; fan++)
+    cancel_delayed_work_sync(&apple->data->sweep[fan].work);
+  cancel_delayed_work_sync(&apple->data->controller);
+  // pending setpoints are moot, the fans are reset right after
+  for (fan = 0; fan < apple->data->nr_fans; fan++)
+    cancel_delayed_work_sync(&apple->data->speed[fan].work);
+  destroy_workqueue(apple->data->wq);
+
+  // never leave the fans in manual mode behind
+  fan_set_auto(apple->data);
+
   apple_fan_sysfs_exit(apple->platform_device);
+out:
+  apple_fan_curves_free(apple->data);
+  free_percpu(apple->data->stats);
+  kfree(apple->data);
   kfree(apple);
   return 0;
 }
@@ -803,7 +5190,7 @@ int __init_or_module
 apple_fan_register_driver(struct apple_fan_driver *driver) {
   struct platform_driver *platform_driver;
   struct platform_device *platform_device;
-  unsigned long state = 0;
+  int err;
 
   dbg_msg("register apple fan driver");
 
@@ -812,21 +5199,25 @@ apple_fan_register_driver(struct apple_fan_driver *driver) {
   }
 
   platform_driver = &driver->platform_driver;
+  platform_driver->probe = apple_fan_probe;
   platform_driver->remove = apple_fan_remove;
   platform_driver->driver.owner = driver->owner;
   platform_driver->driver.name = driver->name;
+  // probe doesn't need the EC, but don't let it hold up other drivers either
+  platform_driver->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
+
+  err = platform_driver_register(platform_driver);
+  if (err)
+    return err;
 
-  platform_device = platform_create_bundle(platform_driver, apple_fan_probe,
-                                           NULL, 0, NULL, 0);
+  // the device shows up once probed, hwmon once the EC answered
+  platform_device = platform_device_register_simple(
+      driver->name, PLATFORM_DEVID_NONE, NULL, 0);
   if (IS_ERR(platform_device)) {
+    platform_driver_unregister(platform_driver);
     return PTR_ERR(platform_device);
   }
-
-  // check current fan(s) state (manual or auto)
-  if (__fan_get_cur_state(0, &state) != 0) {
-    apple_data.fan_manual_mode[0] = true;
-    apple_data.fan_manual_mode[1] = true;
-  }
+  driver->platform_device = platform_device;
 
   used = true;
   return 0;
@@ -835,37 +5226,25 @@ apple_fan_register_driver(struct apple_fan_driver *driver) {
 //// INIT MODULE /////
 static int __init fan_module_init(void) {
   const char *vendor = dmi_get_system_info(DMI_SYS_VENDOR);
-
-  acpi_status ret;
-  int is_vendor = strcmp(vendor, "Apple INC.");
+  int err;
+  // dmi strings are optional, e.g. missing on most VMs
+  int is_vendor = vendor && strcmp(vendor, "Apple Inc.") == 0;
 
   dbg_msg("apple fan driver starting initialization...");
   info_msg("init", "dmi sys info venodr: '%s'", vendor);
   info_msg("init", "dmi product: '%s'", dmi_get_system_info(DMI_PRODUCT_NAME));
   dbg_msg("dmi chassis type: '%s'", dmi_get_system_info(DMI_CHASSIS_TYPE));
 
-  size_t temp = AE_OK;
-  int rpm0 = __fan_rpm(0);
-  int rpm1 = __fan_rpm(1);
+  if (!is_vendor && !sysfs_streq(backend, "sim"))
+    warn_msg("init", "not an apple system, acpi methods may be missing");
 
-  dbg_msg("rpm0=%d, rpm1=%d", rpm0, rpm1);
-
-  ret = apple_fan_register_driver(&apple_fan_driver);
-
-  if (ret != AE_OK) {
-    err_msg("init", "set max speed to: '%d' failed! errcode: %s",
-            apple_data.max_fan_speed_default, acpi_format_exception(ret));
-    return ret;
+  // no EC round-trips here, see apple_fan_init_work()
+  err = apple_fan_register_driver(&apple_fan_driver);
+  if (err) {
+    err_msg("init", "could not register the driver, errcode: %d", err);
+    return err;
   }
 
-  info_msg("init", "created hwmon device: %s",
-           dev_name(apple_data.apple_fan_obj->hwmon_dev));
-  info_msg("init", "finished init, found %d fan(s) to control",
-           (unsigned int)apple_data.has_gfx_fan + 1);
-
-  info_msg("init", "has_gfx_fan=%d, has_fan=%d", apple_data.has_gfx_fan,
-           apple_data.has_fan);
-
   return 0;
 }
 
@@ -876,7 +5255,7 @@ void apple_fan_unregister_driver(struct apple_fan_driver *driver) {
 }
 
 static void __exit fan_module_exit(void) {
-  fan_set_auto();
+  // fans are reset to auto-mode in apple_fan_remove()
   apple_fan_unregister_driver(&apple_fan_driver);
   used = false;
 
@@ -886,6 +5265,12 @@ static void __exit fan_module_exit(void) {
 module_init(fan_module_init);
 module_exit(fan_module_exit);
 
+// tests of the static helpers and handlers above, see t2fan_kunit.c
+// - opt-in ('make T2FAN_KUNIT=1'), never part of a regular build
+#if defined(T2FAN_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+#include "t2fan_kunit.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rinat");
 MODULE_DESCRIPTION("The module for apple mac-book fan");
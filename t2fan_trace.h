@@ -0,0 +1,114 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM apple_fan
+
+#if !defined(_T2FAN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _T2FAN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// length of an acpi name segment (e.g. "SFNV") incl. terminating zero
+#define APPLE_FAN_TRACE_NAME_LEN 5
+
+#define apple_fan_show_mode(mode)                                              \
+  __print_symbolic(mode, {0, "auto"}, {1, "manual"}, {2, "curve"})
+
+// acpi evaluation is about to be issued
+TRACE_EVENT(apple_fan_acpi_eval_enter,
+
+  TP_PROTO(const char *method, u32 nargs, u64 arg0, u64 arg1),
+
+  TP_ARGS(method, nargs, arg0, arg1),
+
+  TP_STRUCT__entry(
+    __array(char, method, APPLE_FAN_TRACE_NAME_LEN)
+    __field(u32, nargs)
+    __field(u64, arg0)
+    __field(u64, arg1)
+  ),
+
+  TP_fast_assign(
+    strscpy(__entry->method, method, APPLE_FAN_TRACE_NAME_LEN);
+    __entry->nargs = nargs;
+    __entry->arg0 = arg0;
+    __entry->arg1 = arg1;
+  ),
+
+  TP_printk("method=%s nargs=%u arg0=%llu arg1=%llu", __entry->method,
+            __entry->nargs, __entry->arg0, __entry->arg1)
+);
+
+// acpi evaluation returned after 'duration' ns
+TRACE_EVENT(apple_fan_acpi_eval_exit,
+
+  TP_PROTO(const char *method, u32 status, u64 value, u64 duration),
+
+  TP_ARGS(method, status, value, duration),
+
+  TP_STRUCT__entry(
+    __array(char, method, APPLE_FAN_TRACE_NAME_LEN)
+    __field(u32, status)
+    __field(u64, value)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    strscpy(__entry->method, method, APPLE_FAN_TRACE_NAME_LEN);
+    __entry->status = status;
+    __entry->value = value;
+    __entry->duration = duration;
+  ),
+
+  TP_printk("method=%s status=0x%x value=%llu duration_ns=%llu",
+            __entry->method, __entry->status, __entry->value,
+            __entry->duration)
+);
+
+// fan speed (pwm) was requested from the EC
+TRACE_EVENT(apple_fan_set_speed,
+
+  TP_PROTO(int fan, int speed),
+
+  TP_ARGS(fan, speed),
+
+  TP_STRUCT__entry(
+    __field(int, fan)
+    __field(int, speed)
+  ),
+
+  TP_fast_assign(
+    __entry->fan = fan;
+    __entry->speed = speed;
+  ),
+
+  TP_printk("fan=%d speed=%d", __entry->fan, __entry->speed)
+);
+
+// fan switched between auto, manual and curve mode
+TRACE_EVENT(apple_fan_set_mode,
+
+  TP_PROTO(int fan, int mode),
+
+  TP_ARGS(fan, mode),
+
+  TP_STRUCT__entry(
+    __field(int, fan)
+    __field(int, mode)
+  ),
+
+  TP_fast_assign(
+    __entry->fan = fan;
+    __entry->mode = mode;
+  ),
+
+  TP_printk("fan=%d mode=%s", __entry->fan,
+            apple_fan_show_mode(__entry->mode))
+);
+
+#endif /* _T2FAN_TRACE_H */
+
+// this part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE t2fan_trace
+#include <trace/define_trace.h>